@@ -92,7 +92,7 @@ static ssize_t pm8001_ctl_tags_alloc_show(struct PMCS_SYSFS_DEV *cdev,
 	struct pm8001_hba_info *pm8001_ha = sha->lldd_ha;
 
 	return snprintf(buf, PAGE_SIZE, "%d\n",
-		pm8001_ha->tags_alloc);
+		atomic_read(&pm8001_ha->tags_alloc));
 }
 static
 PMCS_DEVICE_ATTR(tags_alloc, S_IRUGO, pm8001_ctl_tags_alloc_show, 0);
@@ -329,6 +329,543 @@ static ssize_t pm8001_ctl_logging_level_store(struct PMCS_SYSFS_DEV *cdev,
 static PMCS_DEVICE_ATTR(logging_level, S_IRUGO | S_IWUSR,
 	pm8001_ctl_logging_level_show, pm8001_ctl_logging_level_store);
 
+/**
+ * pm8001_ctl_doorbell_stats_show - IOMBs posted vs inbound doorbell writes
+ * @cdev: pointer to embedded class device
+ * @buf: the buffer returned
+ *
+ * A sysfs 'read-only' shost attribute.
+ */
+static ssize_t pm8001_ctl_doorbell_stats_show(struct PMCS_SYSFS_DEV *cdev,
+	PMCS_ATTR_ARG char *buf)
+{
+	struct Scsi_Host *shost = class_to_shost(cdev);
+	struct sas_ha_struct *sha = SHOST_TO_SAS_HA(shost);
+	struct pm8001_hba_info *pm8001_ha = sha->lldd_ha;
+	u64 iombs = 0, doorbells = 0;
+	ssize_t len = 0;
+	u32 i;
+
+	for (i = 0; i < pm8001_ha->inbnd_q_num; i++) {
+		struct inbound_queue_table *circularQ =
+			&pm8001_ha->inbnd_q_tbl[i];
+		len += snprintf(buf + len, PAGE_SIZE - len,
+			"iq%u: iombs %llu doorbells %llu ci_reads %u\n", i,
+			(unsigned long long)circularQ->iomb_posted,
+			(unsigned long long)circularQ->db_rung,
+			circularQ->ci_reads);
+		iombs += circularQ->iomb_posted;
+		doorbells += circularQ->db_rung;
+	}
+	len += snprintf(buf + len, PAGE_SIZE - len,
+		"total: iombs %llu doorbells %llu batch %u\n",
+		(unsigned long long)iombs, (unsigned long long)doorbells,
+		pm8001_ha->db_batch);
+	return len;
+}
+static PMCS_DEVICE_ATTR(doorbell_stats, S_IRUGO,
+	pm8001_ctl_doorbell_stats_show, NULL);
+
+/**
+ * pm8001_ctl_lock_stats_show - contended acquisitions of the driver locks
+ * @cdev: pointer to embedded class device
+ * @buf: the buffer returned
+ *
+ * A sysfs 'read-only' shost attribute.  Counts the times a lock was found
+ * held and had to be waited for.
+ */
+static ssize_t pm8001_ctl_lock_stats_show(struct PMCS_SYSFS_DEV *cdev,
+	PMCS_ATTR_ARG char *buf)
+{
+	struct Scsi_Host *shost = class_to_shost(cdev);
+	struct sas_ha_struct *sha = SHOST_TO_SAS_HA(shost);
+	struct pm8001_hba_info *pm8001_ha = sha->lldd_ha;
+	ssize_t len = 0;
+	u32 i;
+
+	for (i = 0; i < pm8001_ha->inbnd_q_num; i++)
+		len += snprintf(buf + len, PAGE_SIZE - len,
+			"iq%u: contended %u\n", i,
+			pm8001_ha->inbnd_q_tbl[i].iq_contended);
+	for (i = 0; i < pm8001_ha->outbnd_q_num; i++)
+		len += snprintf(buf + len, PAGE_SIZE - len,
+			"oq%u: contended %u\n", i,
+			pm8001_ha->outbnd_q_tbl[i].oq_contended);
+	len += snprintf(buf + len, PAGE_SIZE - len,
+		"hba: contended %u\n", pm8001_ha->lock_contended);
+	return len;
+}
+static PMCS_DEVICE_ATTR(lock_stats, S_IRUGO,
+	pm8001_ctl_lock_stats_show, NULL);
+
+/**
+ * pm8001_ctl_poll_stats_show - budgeted completion polling per outbound queue
+ * @cdev: pointer to embedded class device
+ * @buf: the buffer returned
+ *
+ * A sysfs 'read-only' shost attribute.  'exhausted' counts passes that
+ * used the whole budget and had to be rescheduled; task_done shows the
+ * callbacks deferred to the end of a drain pass.
+ */
+static ssize_t pm8001_ctl_poll_stats_show(struct PMCS_SYSFS_DEV *cdev,
+	PMCS_ATTR_ARG char *buf)
+{
+	struct Scsi_Host *shost = class_to_shost(cdev);
+	struct sas_ha_struct *sha = SHOST_TO_SAS_HA(shost);
+	struct pm8001_hba_info *pm8001_ha = sha->lldd_ha;
+	u64 tasks = 0, flushes = 0, same = 0, cross = 0, steered = 0, ipis = 0;
+	u32 overflow = 0;
+	ssize_t len = 0;
+	int cpu;
+	u32 i;
+
+	for_each_possible_cpu(cpu) {
+		struct pm8001_done_batch *batch =
+			per_cpu_ptr(pm8001_ha->done_batch, cpu);
+
+		tasks += batch->tasks;
+		flushes += batch->flushes;
+		overflow += batch->overflow;
+		same += batch->same_cpu;
+		cross += batch->cross_cpu;
+		steered += batch->steered;
+		ipis += batch->ipis;
+	}
+	len += snprintf(buf + len, PAGE_SIZE - len, "budget %u\n",
+		pm8001_ha->poll_budget);
+	len += snprintf(buf + len, PAGE_SIZE - len,
+		"task_done: batched %llu flushes %llu overflow %u\n",
+		(unsigned long long)tasks, (unsigned long long)flushes,
+		overflow);
+	len += snprintf(buf + len, PAGE_SIZE - len,
+		"cpu: same %llu cross %llu steered %llu ipis %llu\n",
+		(unsigned long long)same, (unsigned long long)cross,
+		(unsigned long long)steered, (unsigned long long)ipis);
+	for (i = 0; i < pm8001_ha->outbnd_q_num; i++) {
+		struct outbound_queue_table *circularQ =
+			&pm8001_ha->outbnd_q_tbl[i];
+
+		len += snprintf(buf + len, PAGE_SIZE - len,
+			"oq%u: passes %u iombs %llu max %u exhausted %u"
+			" ci_writes %u\n", i, circularQ->poll_passes,
+			(unsigned long long)circularQ->iombs,
+			circularQ->poll_max, circularQ->poll_exhausted,
+			circularQ->ci_writes);
+	}
+	return len;
+}
+static PMCS_DEVICE_ATTR(poll_stats, S_IRUGO,
+	pm8001_ctl_poll_stats_show, NULL);
+
+/**
+ * pm8001_ctl_coalesce_show - outbound interrupt coalescing per queue
+ * @cdev: pointer to embedded class device
+ * @buf: the buffer returned
+ *
+ * A sysfs 'read/write' shost attribute.  Shows the mode, each queue's
+ * count and delay, and interrupts taken per thousand completions.
+ */
+static ssize_t pm8001_ctl_coalesce_show(struct PMCS_SYSFS_DEV *cdev,
+	PMCS_ATTR_ARG char *buf)
+{
+	struct Scsi_Host *shost = class_to_shost(cdev);
+	struct sas_ha_struct *sha = SHOST_TO_SAS_HA(shost);
+	struct pm8001_hba_info *pm8001_ha = sha->lldd_ha;
+	ssize_t len = 0;
+	u32 i;
+
+	len += snprintf(buf + len, PAGE_SIZE - len, "mode %s\n",
+		pm8001_ha->coal_adaptive ? "adaptive" : "fixed");
+	for (i = 0; i < pm8001_ha->outbnd_q_num; i++) {
+		struct outbound_queue_table *circularQ =
+			&pm8001_ha->outbnd_q_tbl[i];
+		u64 per_k = circularQ->iombs ?
+			div64_u64(circularQ->irqs * 1000, circularQ->iombs) : 0;
+
+		len += snprintf(buf + len, PAGE_SIZE - len,
+			"oq%u: count %u delay %u irqs %llu iombs %llu"
+			" irqs/1000 %llu\n", i, circularQ->coal_count,
+			circularQ->coal_delay,
+			(unsigned long long)circularQ->irqs,
+			(unsigned long long)circularQ->iombs,
+			(unsigned long long)per_k);
+	}
+	return len;
+}
+
+/**
+ * pm8001_ctl_coalesce_store - set the coalescing policy
+ * @cdev: pointer to embedded class device
+ * @buf: "adaptive", "fixed", or "<queue> <count> <delay>"
+ * @count: size of @buf
+ *
+ * "fixed" keeps each queue at its current values; setting a queue's
+ * count and delay also turns adaptive mode off.
+ */
+static ssize_t pm8001_ctl_coalesce_store(struct PMCS_SYSFS_DEV *cdev,
+	PMCS_ATTR_ARG const char *buf, size_t count)
+{
+	struct Scsi_Host *shost = class_to_shost(cdev);
+	struct sas_ha_struct *sha = SHOST_TO_SAS_HA(shost);
+	struct pm8001_hba_info *pm8001_ha = sha->lldd_ha;
+	u32 q, coal_count, coal_delay;
+
+	if (!strncmp(buf, "adaptive", 8)) {
+		pm8001_ha->coal_adaptive = 1;
+		return count;
+	}
+	if (!strncmp(buf, "fixed", 5)) {
+		pm8001_ha->coal_adaptive = 0;
+		return count;
+	}
+	if ((sscanf(buf, "%u %u %u", &q, &coal_count, &coal_delay) != 3) ||
+		(q >= pm8001_ha->outbnd_q_num) ||
+		(coal_count > PM8001_COAL_COUNT_MAX) ||
+		(coal_delay > PM8001_COAL_DELAY_MAX))
+		return -EINVAL;
+
+	pm8001_ha->coal_adaptive = 0;
+	/* an adaptive change still queued must not undo this one */
+	cancel_work_sync(&pm8001_ha->coal_work);
+	pm8001_ha->coal_dirty = 0;
+	if (pm8001_set_coalesce(pm8001_ha, q, coal_count, coal_delay))
+		return -EIO;
+	return count;
+}
+static PMCS_DEVICE_ATTR(coalesce, S_IRUGO | S_IWUSR,
+	pm8001_ctl_coalesce_show, pm8001_ctl_coalesce_store);
+
+/**
+ * pm8001_ctl_spin_usecs_show - hybrid polled completion time limit
+ * @cdev: pointer to embedded class device
+ * @buf: the buffer returned
+ *
+ * A sysfs 'read/write' shost attribute.  An SSP submitter spins on its
+ * outbound queue this long, at most PM8001_SPIN_USECS_MAX, before
+ * leaving the I/O to the interrupt; 0 turns polling off.
+ */
+static ssize_t pm8001_ctl_spin_usecs_show(struct PMCS_SYSFS_DEV *cdev,
+	PMCS_ATTR_ARG char *buf)
+{
+	struct Scsi_Host *shost = class_to_shost(cdev);
+	struct sas_ha_struct *sha = SHOST_TO_SAS_HA(shost);
+	struct pm8001_hba_info *pm8001_ha = sha->lldd_ha;
+
+	return snprintf(buf, PAGE_SIZE, "%u\n", pm8001_ha->spin_usecs);
+}
+static ssize_t pm8001_ctl_spin_usecs_store(struct PMCS_SYSFS_DEV *cdev,
+	PMCS_ATTR_ARG const char *buf, size_t count)
+{
+	struct Scsi_Host *shost = class_to_shost(cdev);
+	struct sas_ha_struct *sha = SHOST_TO_SAS_HA(shost);
+	struct pm8001_hba_info *pm8001_ha = sha->lldd_ha;
+	u32 val;
+
+	if ((sscanf(buf, "%u", &val) != 1) || (val > PM8001_SPIN_USECS_MAX))
+		return -EINVAL;
+	pm8001_ha->spin_usecs = val;
+	return count;
+}
+static PMCS_DEVICE_ATTR(spin_usecs, S_IRUGO | S_IWUSR,
+	pm8001_ctl_spin_usecs_show, pm8001_ctl_spin_usecs_store);
+
+/**
+ * pm8001_ctl_completion_latency_show - ssp completion latency histogram
+ * @cdev: pointer to embedded class device
+ * @buf: the buffer returned
+ *
+ * A sysfs 'read-only' shost attribute.  Submission to completion IOMB,
+ * summed over the outbound queues, split by whether the interrupt path
+ * or a spinning submitter reaped it.  Only counted while spin_usecs is
+ * set.
+ */
+static ssize_t pm8001_ctl_completion_latency_show(struct PMCS_SYSFS_DEV *cdev,
+	PMCS_ATTR_ARG char *buf)
+{
+	struct Scsi_Host *shost = class_to_shost(cdev);
+	struct sas_ha_struct *sha = SHOST_TO_SAS_HA(shost);
+	struct pm8001_hba_info *pm8001_ha = sha->lldd_ha;
+	ssize_t len = 0;
+	u64 irq, spin;
+	u32 i, b;
+
+	len += snprintf(buf + len, PAGE_SIZE - len,
+		"spin hits %u misses %u\n",
+		atomic_read(&pm8001_ha->spin_hits),
+		atomic_read(&pm8001_ha->spin_misses));
+	for (b = 0; b < PM8001_LAT_BUCKETS; b++) {
+		irq = spin = 0;
+		for (i = 0; i < pm8001_ha->outbnd_q_num; i++) {
+			irq += pm8001_ha->outbnd_q_tbl[i].lat_hist[0][b];
+			spin += pm8001_ha->outbnd_q_tbl[i].lat_hist[1][b];
+		}
+		len += snprintf(buf + len, PAGE_SIZE - len,
+			"%s%6uus: irq %llu spin %llu\n",
+			(b == PM8001_LAT_BUCKETS - 1) ? ">=" : "< ",
+			(b == PM8001_LAT_BUCKETS - 1) ? 1U << (b - 1) : 1U << b,
+			(unsigned long long)irq, (unsigned long long)spin);
+	}
+	return len;
+}
+static PMCS_DEVICE_ATTR(completion_latency, S_IRUGO,
+	pm8001_ctl_completion_latency_show, NULL);
+
+/**
+ * pm8001_ctl_host_reset_time_show - how long the last host reset took
+ * @cdev: pointer to embedded class device
+ * @buf: the buffer returned
+ *
+ * A sysfs 'read-only' shost attribute.  Times are in usec, per phase.
+ */
+static ssize_t pm8001_ctl_host_reset_time_show(struct PMCS_SYSFS_DEV *cdev,
+	PMCS_ATTR_ARG char *buf)
+{
+	struct Scsi_Host *shost = class_to_shost(cdev);
+	struct sas_ha_struct *sha = SHOST_TO_SAS_HA(shost);
+	struct pm8001_hba_info *pm8001_ha = sha->lldd_ha;
+
+	return snprintf(buf, PAGE_SIZE,
+		"resets %u total %u chip %u phy %u reregister %u"
+		" devices %u depth %u\n", pm8001_ha->reset_count,
+		pm8001_ha->reset_usecs, pm8001_ha->reset_chip_usecs,
+		pm8001_ha->reset_phy_usecs, pm8001_ha->reset_rereg_usecs,
+		pm8001_ha->reset_rereg_devs, pm8001_ha->reset_rereg_depth);
+}
+static PMCS_DEVICE_ATTR(host_reset_time, S_IRUGO,
+	pm8001_ctl_host_reset_time_show, NULL);
+
+/**
+ * pm8001_ctl_event_pool_show - deferred event work item pool usage
+ * @cdev: pointer to embedded class device
+ * @buf: the buffer returned
+ *
+ * A sysfs 'read-only' shost attribute.  exhausted counts the events that
+ * found the pool empty and had to allocate.
+ */
+static ssize_t pm8001_ctl_event_pool_show(struct PMCS_SYSFS_DEV *cdev,
+	PMCS_ATTR_ARG char *buf)
+{
+	struct Scsi_Host *shost = class_to_shost(cdev);
+	struct sas_ha_struct *sha = SHOST_TO_SAS_HA(shost);
+	struct pm8001_hba_info *pm8001_ha = sha->lldd_ha;
+
+	return snprintf(buf, PAGE_SIZE,
+		"size %u busy %d high %u exhausted %d\n", pm8001_ha->work_num,
+		atomic_read(&pm8001_ha->work_busy), pm8001_ha->work_high,
+		atomic_read(&pm8001_ha->work_exhausted));
+}
+static PMCS_DEVICE_ATTR(event_pool, S_IRUGO, pm8001_ctl_event_pool_show,
+	NULL);
+
+/**
+ * pm8001_ctl_orej_stats_show - open reject retries, per device
+ * @cdev: pointer to embedded class device
+ * @buf: the buffer returned
+ *
+ * A sysfs 'read-only' shost attribute.  Lists the devices that have had
+ * retries: how many, how many were held back, the current backoff in msec
+ * and the retries seen in the last full second.
+ */
+static ssize_t pm8001_ctl_orej_stats_show(struct PMCS_SYSFS_DEV *cdev,
+	PMCS_ATTR_ARG char *buf)
+{
+	struct Scsi_Host *shost = class_to_shost(cdev);
+	struct sas_ha_struct *sha = SHOST_TO_SAS_HA(shost);
+	struct pm8001_hba_info *pm8001_ha = sha->lldd_ha;
+	ssize_t len = 0;
+	u32 i;
+
+	len += snprintf(buf + len, PAGE_SIZE - len, "held now %u\n",
+		pm8001_ha->orej_pending);
+	for (i = 0; i < PM8001_MAX_DEVICES; i++) {
+		struct pm8001_device *pm8001_dev = &pm8001_ha->devices[i];
+
+		if ((pm8001_dev->dev_type == NO_DEVICE) ||
+		    !pm8001_dev->orej_retries || !pm8001_dev->sas_device)
+			continue;
+		if (len >= PAGE_SIZE - 80)
+			break;
+		len += snprintf(buf + len, PAGE_SIZE - len,
+			"dev %u 0x%016llx retries %u held %u backoff %ums"
+			" rate %u/s\n", pm8001_dev->id,
+			SAS_ADDR(pm8001_dev->sas_device->sas_addr),
+			pm8001_dev->orej_retries, pm8001_dev->orej_held,
+			pm8001_dev->orej_backoff, pm8001_dev->orej_rate);
+	}
+	return len;
+}
+static PMCS_DEVICE_ATTR(orej_stats, S_IRUGO, pm8001_ctl_orej_stats_show,
+	NULL);
+
+/**
+ * pm8001_ctl_abort_stats_show - error recovery aborts
+ * @cdev: pointer to embedded class device
+ * @buf: the buffer returned
+ *
+ * A sysfs 'read-only' shost attribute.  single counts per task aborts,
+ * all the device wide aborts that replaced them and swept the commands
+ * those took down.
+ */
+static ssize_t pm8001_ctl_abort_stats_show(struct PMCS_SYSFS_DEV *cdev,
+	PMCS_ATTR_ARG char *buf)
+{
+	struct Scsi_Host *shost = class_to_shost(cdev);
+	struct sas_ha_struct *sha = SHOST_TO_SAS_HA(shost);
+	struct pm8001_hba_info *pm8001_ha = sha->lldd_ha;
+
+	return snprintf(buf, PAGE_SIZE, "single %d all %d swept %d\n",
+		atomic_read(&pm8001_ha->abort_single),
+		atomic_read(&pm8001_ha->abort_all),
+		atomic_read(&pm8001_ha->abort_swept));
+}
+static PMCS_DEVICE_ATTR(abort_stats, S_IRUGO, pm8001_ctl_abort_stats_show,
+	NULL);
+
+/**
+ * pm8001_ctl_stuck_commands_show - stalled command counts
+ * @cdev: pointer to embedded class device
+ * @buf: the buffer returned
+ *
+ * A sysfs 'read-only' shost attribute.  flagged counts commands the stall
+ * scan found past their device's stall time, timed_out those still in
+ * flight when they were handed to the midlayer's EH; now is how many
+ * flagged commands are still outstanding.
+ */
+static ssize_t pm8001_ctl_stuck_commands_show(struct PMCS_SYSFS_DEV *cdev,
+	PMCS_ATTR_ARG char *buf)
+{
+	struct Scsi_Host *shost = class_to_shost(cdev);
+	struct sas_ha_struct *sha = SHOST_TO_SAS_HA(shost);
+	struct pm8001_hba_info *pm8001_ha = sha->lldd_ha;
+	struct pm8001_device *pm8001_dev;
+	struct pm8001_ccb_info *ccb;
+	unsigned long flags;
+	ssize_t len = 0;
+	u32 i, now = 0;
+
+	for (i = 0; i < PM8001_MAX_DEVICES; i++) {
+		pm8001_dev = &pm8001_ha->devices[i];
+		if (pm8001_dev->dev_type == NO_DEVICE)
+			continue;
+		spin_lock_irqsave(&pm8001_dev->ccb_lock, flags);
+		list_for_each_entry(ccb, &pm8001_dev->ccb_list, dev_list)
+			if (ccb->stalled)
+				now++;
+		spin_unlock_irqrestore(&pm8001_dev->ccb_lock, flags);
+	}
+	len += snprintf(buf + len, PAGE_SIZE - len,
+		"flagged %d timed_out %d now %u\n",
+		atomic_read(&pm8001_ha->stall_flagged),
+		atomic_read(&pm8001_ha->stall_timedout), now);
+	for (i = 0; i < PM8001_MAX_DEVICES; i++) {
+		pm8001_dev = &pm8001_ha->devices[i];
+		if ((pm8001_dev->dev_type == NO_DEVICE) ||
+		    !pm8001_dev->stuck || !pm8001_dev->sas_device)
+			continue;
+		if (len >= PAGE_SIZE - 80)
+			break;
+		len += snprintf(buf + len, PAGE_SIZE - len,
+			"dev %u 0x%016llx stuck %u stall %ums\n", pm8001_dev->id,
+			SAS_ADDR(pm8001_dev->sas_device->sas_addr),
+			pm8001_dev->stuck, pm8001_dev->stall_ms);
+	}
+	return len;
+}
+static PMCS_DEVICE_ATTR(stuck_commands, S_IRUGO,
+	pm8001_ctl_stuck_commands_show, NULL);
+
+/**
+ * pm8001_ctl_stall_timeout_show - stall detection threshold
+ * @cdev: pointer to embedded class device
+ * @buf: the buffer returned
+ *
+ * A sysfs 'read/write' shost attribute.  msec an outstanding command may
+ * take before it is timed out early; 0, the default, turns stall detection
+ * off.
+ */
+static ssize_t pm8001_ctl_stall_timeout_show(struct PMCS_SYSFS_DEV *cdev,
+	PMCS_ATTR_ARG char *buf)
+{
+	struct Scsi_Host *shost = class_to_shost(cdev);
+	struct sas_ha_struct *sha = SHOST_TO_SAS_HA(shost);
+	struct pm8001_hba_info *pm8001_ha = sha->lldd_ha;
+
+	return snprintf(buf, PAGE_SIZE, "%u\n", pm8001_ha->stall_ms);
+}
+
+/**
+ * pm8001_ctl_stall_timeout_store - set the stall detection threshold
+ * @cdev: pointer to embedded class device
+ * @buf: "<msec>" for every device, or "<dev> <msec>" for one
+ * @count: size of @buf
+ */
+static ssize_t pm8001_ctl_stall_timeout_store(struct PMCS_SYSFS_DEV *cdev,
+	PMCS_ATTR_ARG const char *buf, size_t count)
+{
+	struct Scsi_Host *shost = class_to_shost(cdev);
+	struct sas_ha_struct *sha = SHOST_TO_SAS_HA(shost);
+	struct pm8001_hba_info *pm8001_ha = sha->lldd_ha;
+	u32 i, dev, ms;
+
+	switch (sscanf(buf, "%u %u", &dev, &ms)) {
+	case 1:
+		pm8001_ha->stall_ms = dev;
+		for (i = 0; i < PM8001_MAX_DEVICES; i++)
+			pm8001_ha->devices[i].stall_ms = dev;
+		if (dev)
+			pm8001_stall_start(pm8001_ha);
+		return count;
+	case 2:
+		if (dev >= PM8001_MAX_DEVICES)
+			return -EINVAL;
+		pm8001_ha->devices[dev].stall_ms = ms;
+		if (ms)
+			pm8001_stall_start(pm8001_ha);
+		return count;
+	}
+	return -EINVAL;
+}
+static PMCS_DEVICE_ATTR(stall_timeout, S_IRUGO | S_IWUSR,
+	pm8001_ctl_stall_timeout_show, pm8001_ctl_stall_timeout_store);
+
+#ifdef PM8001_COMPLETION_PROFILE
+/**
+ * pm8001_ctl_completion_stats_show - mean cycles per SSP/SATA completion
+ * @cdev: pointer to embedded class device
+ * @buf: the buffer returned
+ *
+ * A sysfs 'read-only' shost attribute.
+ */
+static ssize_t pm8001_ctl_completion_stats_show(struct PMCS_SYSFS_DEV *cdev,
+	PMCS_ATTR_ARG char *buf)
+{
+	struct Scsi_Host *shost = class_to_shost(cdev);
+	struct sas_ha_struct *sha = SHOST_TO_SAS_HA(shost);
+	struct pm8001_hba_info *pm8001_ha = sha->lldd_ha;
+	ssize_t len = 0;
+	u32 i;
+
+	for (i = 0; i < pm8001_ha->outbnd_q_num; i++) {
+		struct outbound_queue_table *circularQ =
+			&pm8001_ha->outbnd_q_tbl[i];
+		u64 ssp = circularQ->ssp_comp ? div64_u64(circularQ->ssp_cycles,
+			circularQ->ssp_comp) : 0;
+		u64 sata = circularQ->sata_comp ?
+			div64_u64(circularQ->sata_cycles, circularQ->sata_comp) : 0;
+
+		len += snprintf(buf + len, PAGE_SIZE - len,
+			"oq%u: ssp %llu x %llu cycles sata %llu x %llu cycles\n",
+			i, (unsigned long long)circularQ->ssp_comp,
+			(unsigned long long)ssp,
+			(unsigned long long)circularQ->sata_comp,
+			(unsigned long long)sata);
+	}
+	return len;
+}
+static PMCS_DEVICE_ATTR(completion_stats, S_IRUGO,
+	pm8001_ctl_completion_stats_show, NULL);
+#endif
+
 #if	PMDEBUG > 0
 /**
  * pm8001_ctl_allocation_show - memory allocation amount
@@ -761,6 +1298,21 @@ struct PMCS_SYSFS_DEV_ATTR *pm8001_host_attrs[] = {
 	&class_device_attr_sas_spec_support,
 	&class_device_attr_logging_level,
 	&class_device_attr_host_sas_address,
+	&class_device_attr_doorbell_stats,
+	&class_device_attr_lock_stats,
+	&class_device_attr_poll_stats,
+	&class_device_attr_coalesce,
+	&class_device_attr_spin_usecs,
+	&class_device_attr_completion_latency,
+	&class_device_attr_host_reset_time,
+	&class_device_attr_event_pool,
+	&class_device_attr_orej_stats,
+	&class_device_attr_abort_stats,
+	&class_device_attr_stuck_commands,
+	&class_device_attr_stall_timeout,
+#ifdef PM8001_COMPLETION_PROFILE
+	&class_device_attr_completion_stats,
+#endif
 	NULL,
 };
 #else
@@ -778,6 +1330,21 @@ struct PMCS_SYSFS_DEV_ATTR *pm8001_host_attrs[] = {
 	&dev_attr_sas_spec_support,
 	&dev_attr_logging_level,
 	&dev_attr_host_sas_address,
+	&dev_attr_doorbell_stats,
+	&dev_attr_lock_stats,
+	&dev_attr_poll_stats,
+	&dev_attr_coalesce,
+	&dev_attr_spin_usecs,
+	&dev_attr_completion_latency,
+	&dev_attr_host_reset_time,
+	&dev_attr_event_pool,
+	&dev_attr_orej_stats,
+	&dev_attr_abort_stats,
+	&dev_attr_stuck_commands,
+	&dev_attr_stall_timeout,
+#ifdef PM8001_COMPLETION_PROFILE
+	&dev_attr_completion_stats,
+#endif
 	NULL,
 };
 #endif
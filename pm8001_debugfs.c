@@ -741,22 +741,26 @@ pm8001_debugfs_forensic_queue_cipi_open(
 	debug->write = NULL;
 
 	for (i = 0; i < num; ++i) {
+		uint32_t val;
+
 		/* For i'th queue */
-		ind = IB + i;
-		if (strncmp(parent->d_name.name, "oq", 2) == 0)
-			ind += OB - IB;
-
-		debug->blob.size += snprintf(debug->buffer,
-		debug->allocation.size,
-		"[0x%04x] : 0x%x\n",
-		i,
-		((strncmp(file->f_dentry->d_name.name, "ci", 2) == 0) ?
-		(((OB > IB) ? (ind < OB) : (ind >= IB)) ?
-		 *((uint32_t *)(pm8001_ha->memoryMap.region[CI].virt_ptr)) :
-		 pm8001_ha->outbnd_q_tbl[0].consumer_idx) :
-		(((OB > IB) ? (ind < OB) : (ind >= IB)) ?
-		 pm8001_ha->inbnd_q_tbl[0].producer_idx :
-		 *((uint32_t *)(pm8001_ha->memoryMap.region[PI].virt_ptr)))));
+		if (ind == CI) {
+			struct inbound_queue_table *iq =
+				&pm8001_ha->inbnd_q_tbl[i];
+			val = (strncmp(file->f_dentry->d_name.name, "ci", 2)
+				== 0) ? *((uint32_t *)iq->ci_virt) :
+				iq->producer_idx;
+		} else {
+			struct outbound_queue_table *oq =
+				&pm8001_ha->outbnd_q_tbl[i];
+			val = (strncmp(file->f_dentry->d_name.name, "ci", 2)
+				== 0) ? oq->consumer_idx :
+				*((uint32_t *)oq->pi_virt);
+		}
+		debug->blob.size += snprintf(
+			debug->buffer + debug->blob.size,
+			debug->allocation.size - debug->blob.size,
+			"[0x%04x] : 0x%x\n", i, val);
 	}
 	file->private_data = debug;
 
@@ -894,6 +898,7 @@ pm8001_debugfs_forensic_queue_open(struct inode *inode, struct file *file)
 	int rc = -ENOMEM;
 	size_t size;
 	int cur_iomb, num;
+	char *base;
 
 	parent = inode->i_private;
 #if defined(PM8001_DEBUGFS_DEBUG)
@@ -901,13 +906,19 @@ pm8001_debugfs_forensic_queue_open(struct inode *inode, struct file *file)
 		parent->d_parent->d_parent->d_name.name,
 		parent->d_parent->d_name.name, parent->d_name.name);
 #endif
-	ind = IB + atoi(parent->d_name.name);
+	ind = IB;
 	if (strncmp(parent->d_parent->d_name.name, "oq", 2) == 0)
 		ind += OB - IB;
 	pm8001_ha = parent->d_fsdata;
-	/* Cal. no. of IOMBs in the 'ind'th Queue and Size of this Queue */
-	num  = pm8001_ha->memoryMap.region[ind].num_elements;
+	/*
+	 * All queues of one direction share a region; cal. no. of IOMBs in
+	 * one Queue and the start of the requested Queue within the region.
+	 */
+	num  = pm8001_ha->memoryMap.region[ind].num_elements /
+		pm8001_ha->memoryMap.region[(ind == IB) ? CI : PI].num_elements;
 	size = pm8001_ha->memoryMap.region[ind].element_size;
+	base = ((char *)pm8001_ha->memoryMap.region[ind].virt_ptr) +
+		(atoi(parent->d_name.name) * num * size);
 
 #if defined(PM8001_DEBUGFS_DEBUG)
 	pm8001_printk("pm8001_ha->memoryMap.region[%d].num_elements=%d",
@@ -929,8 +940,7 @@ pm8001_debugfs_forensic_queue_open(struct inode *inode, struct file *file)
 	debug->blob.size = 0;
 	for (cur_iomb = 0; cur_iomb < num; ++cur_iomb) {
 		pm8001_debugfs_forensic_dump(debug,	QUEUE_FORMAT,
-			((char *)pm8001_ha->memoryMap.region[ind].virt_ptr) +
-				(cur_iomb * size), size, cur_iomb);
+			base + (cur_iomb * size), size, cur_iomb);
 	}
 	debug->write = NULL;
 	file->private_data = debug;
@@ -3247,6 +3257,83 @@ pm8001_debugfs_forensic_op = {
 	}
 };
 
+/* reset_timeline */
+
+static const char * const pm8001_reset_event_name[] = {
+	[PM8001_RESET_CHIP_RST] = "chip reset",
+	[PM8001_RESET_CHIP_INIT] = "chip init",
+	[PM8001_RESET_PHY_START] = "phy start",
+	[PM8001_RESET_PHY_STARTED] = "phy started",
+	[PM8001_RESET_PHY_LINK_RESET] = "phy link reset",
+	[PM8001_RESET_PHY_UP] = "phy up",
+	[PM8001_RESET_PHY_TIMEOUT] = "phy up timeout",
+	[PM8001_RESET_REREG] = "devices registered",
+	[PM8001_RESET_DONE] = "done",
+};
+
+/*
+ *	pm8001_debugfs_reset_timeline_open - Open the last host reset timeline
+ *	@inode: The inode pointer
+ *	@file: The file pointer to attach the timeline
+ *
+ *	Description:
+ *	This routine is the entry point for the debugfs open file operation. It
+ *	formats each milestone of the last host reset, in usec from its start,
+ *	and returns a pointer to that data in the private_data field in @file.
+ */
+static int
+pm8001_debugfs_reset_timeline_open(
+	struct inode *inode,
+	struct file *file)
+{
+	struct dentry *parent;
+	struct pm8001_hba_info *pm8001_ha;
+	struct pm8001_debug *debug;
+	int i, n, len, rc = -ENOMEM;
+
+	parent = inode->i_private;
+	pm8001_ha = parent->d_fsdata;
+	n = min_t(int, atomic_read(&pm8001_ha->reset_nmark),
+		PM8001_RESET_MARKS);
+	len = (n + 1) * sizeof("0123456789us devices registered 65535\n");
+	debug = kmalloc(sizeof(*debug) + len, GFP_KERNEL);
+	if (!debug)
+		goto out;
+
+	debug->allocation.size = len;
+	debug->blob.data = debug->buffer;
+	debug->blob.size = 0;
+	for (i = 0; i < n; i++) {
+		struct pm8001_reset_mark *mark = &pm8001_ha->reset_mark[i];
+
+		debug->blob.size += snprintf(debug->buffer + debug->blob.size,
+			len - debug->blob.size, "%10uus %s %u\n", mark->usecs,
+			(mark->event < ARRAY_SIZE(pm8001_reset_event_name)) ?
+			pm8001_reset_event_name[mark->event] : "?", mark->phy);
+	}
+	debug->write = NULL;
+	file->private_data = debug;
+
+	rc = 0;
+out:
+	return rc;
+}
+
+static const struct pm8001_file_operations
+pm8001_debugfs_op_reset_timeline = {
+	{
+		.name = "reset_timeline",
+		.type = PM8001_OP_FILE_RO
+	},
+	{
+		.owner =   THIS_MODULE,
+		.open =	   pm8001_debugfs_reset_timeline_open,
+		.llseek =  pm8001_debugfs_lseek,
+		.read =	   pm8001_debugfs_read,
+		.release = pm8001_debugfs_release,
+	}
+};
+
 static struct dentry *pm8001_debugfs_root;
 static atomic_t pm8001_debugfs_hba_count;
 #endif
@@ -3297,6 +3384,11 @@ void pm8001_debugfs_initialize(struct pm8001_hba_info *pm8001_ha)
 				pm8001_ha->hba_debugfs_root, pm8001_ha, name)) {
 			goto debug_failed;
 		}
+		if (pm8001_debugfs_build_tree(
+				&pm8001_debugfs_op_reset_timeline.header,
+				pm8001_ha->hba_debugfs_root, pm8001_ha, name)) {
+			goto debug_failed;
+		}
 	}
 debug_failed:
 	return;
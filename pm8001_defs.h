@@ -88,6 +88,11 @@ static inline void INIT_WORK_compat(struct work_struct *work, void *func)
 #define sg_page(_sg) ((_sg)->page)
 #endif
 
+/* irq_set_affinity_hint went upstream in 2.6.35, RHEL6 carries it */
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 35)) || defined(RHEL_MAJOR)
+#define PMCS_HAVE_AFFINITY_HINT
+#endif
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,24)
 #include <linux/kernel.h>
 #include <scsi/sas.h>
@@ -127,6 +132,9 @@ enum chip_flavors {
 	chip_8001,
 };
 #define PM8001_MAX_DMA_SG		SG_ALL
+/* external sg tables come from pools of these many PRDs */
+#define	PM8001_SGL_CLASSES		3
+#define	PM8001_SGL_CLASS_SIZES		{ 16, 64, PM8001_MAX_DMA_SG }
 enum phy_speed {
 	PHY_SPEED_15 = 0x01,
 	PHY_SPEED_30 = 0x02,
@@ -148,19 +156,79 @@ enum port_type {
 /* driver compile-time configuration */
 #define	PM8001_MAX_CCB_ARRAY	 1
 #if (PM8001_MAX_CCB_ARRAY == 1)
-#define	PM8001_MAX_CCB		 512	/* max ccbs supported */
+#define	PM8001_MAX_CCB		 4096	/* max ccbs supported */
 #else
 #define	PM8001_CCB_PER_ARRAY	 512
 #define	PM8001_MAX_CCB		 (PM8001_CCB_PER_ARRAY * PM8001_MAX_CCB_ARRAY)
 #endif
-/* maximum mpi queue entries */
-#define PM8001_MPI_QUEUE         ((PM8001_MAX_CCB) * 2)
+/* ccbs allocated at probe, see the max_ccb module parameter */
+#define	PM8001_MIN_CCB		 256
+#define	PM8001_DEF_CCB		 512
+/* mpi queue entries per queue, rounded to a power of two at probe */
+#define PM8001_MPI_QUEUE_MIN     64
+#define PM8001_MPI_QUEUE_DEF     1024
+#define PM8001_MPI_QUEUE_MAX     4096
+/* the IB and OB regions are one coherent allocation each, alignment too */
+#define	PM8001_MPI_REGION_MAX	 (2 * 1024 * 1024)
 
-#define	PM8001_MAX_INB_NUM	 1
-#define	PM8001_MAX_OUTB_NUM	 1
+/* inbound queues are spread across submitting cpus */
+#define	PM8001_MAX_INB_NUM	 16
+/* inbound queue 0 is high priority, for error recovery and discovery */
+#define	PM8001_HIPRI_IQ		 0
+/* outbound queues are drained by one msi-x vector each */
+#define	PM8001_MAX_OUTB_NUM	 16
+#define	PM8001_MAX_MSIX_VEC	 16
+/* tasks completed per drain pass before task_done runs under the lock */
+#define	PM8001_DONE_BATCH	 64
+/* outbound IOMBs consumed between consumer index writes to the chip */
+#define	PM8001_OQ_CI_BATCH	 16
+/* outbound interrupt coalescing: count in IOMBs, delay in usec */
+#define	PM8001_COAL_COUNT_MAX	 255
+#define	PM8001_COAL_DELAY_MAX	 65535
+/* adaptive coalescing: per queue ceilings, re-evaluated each interval */
+#define	PM8001_COAL_ADAPT_COUNT	 32
+#define	PM8001_COAL_ADAPT_DELAY	 32
+#define	PM8001_COAL_INTERVAL	 (HZ / 10)
+/* completions per second on a queue before it is worth coalescing */
+#define	PM8001_COAL_RATE	 10000
+/* ssp completion latency histogram, log2 usec buckets */
+#define	PM8001_LAT_BUCKETS	 16
+/* longest a submitter may spin for its completion, usec */
+#define	PM8001_SPIN_USECS_MAX	 1000
+/* high priority queue entries left free while devices re-register */
+#define	PM8001_REREG_RESERVE	 8
+/* and how long the ones that could not be posted wait to be tried again */
+#define	PM8001_REREG_RETRY_MS	 100
+/* host reset: how long to wait for phy start status and for links */
+#define	PM8001_PHY_START_TIMEOUT (HZ)
+#define	PM8001_PHY_UP_TIMEOUT	 (2 * HZ)
+/* host reset timeline entries kept for debugfs */
+#define	PM8001_RESET_MARKS	 64
+/* open reject backoff: per device delay doubles from min to max, jittered */
+#define	PM8001_OREJ_MIN_MS	 10
+#define	PM8001_OREJ_MAX_MS	 1000
+/* rejects further apart than this start the backoff over */
+#define	PM8001_OREJ_DECAY_MS	 2000
+/* backoff timer wheel, one jiffy a slot, long enough for the max delay */
+#define	PM8001_OREJ_SLOTS	 (DIV_ROUND_UP(PM8001_OREJ_MAX_MS * HZ, 1000) + 1)
+/*
+ * error recovery: once a device has this many aborts, or a failed one,
+ * within the window and still this many commands in flight, abort them all
+ */
+#define	PM8001_ABORT_ALL_AFTER	 4
+#define	PM8001_ABORT_ALL_MIN	 8
+#define	PM8001_ABORT_WINDOW	 (10 * HZ)
+/*
+ * stall detection: scan every tick for commands older than the device's
+ * stall time, timing out at most a batch per device per tick
+ */
+#define	PM8001_STALL_TICK	 (HZ)
+#define	PM8001_STALL_MS		 0	/* off */
+#define	PM8001_STALL_BATCH	 4
+/* commands the midlayer gave a longer timeout than this are left alone */
+#define	PM8001_STALL_CMD_MAX	 (60 * HZ)
+/* ccbs held back from the SCSI queue depth for internal commands */
 #define PM8001_RESERVED_CCB      176
-/* SCSI Queue depth */
-#define	PM8001_CAN_QUEUE	 (PM8001_MAX_CCB - PM8001_RESERVED_CCB)
 #define PM8001_MAX_HW_SECTORS	 32768  /* Max 512 byte sectors per transfer */
 
 /* unchangeable hardware details */
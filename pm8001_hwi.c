@@ -41,6 +41,9 @@
  */
 #include <linux/slab.h>
 #include <linux/stringify.h>
+#include <linux/prefetch.h>
+#include <linux/random.h>
+#include <scsi/scsi_cmnd.h>
 #include "pm8001_sas.h"
 #include "pm8001_hwi.h"
 #include "pm8001_chips.h"
@@ -137,10 +140,9 @@ read_general_status_table(struct pm8001_hba_info *pm8001_ha)
 static void
 read_inbnd_queue_table(struct pm8001_hba_info *pm8001_ha)
 {
-	int inbQ_num = 1;
 	int i;
 	void __iomem *address = pm8001_ha->inbnd_q_tbl_addr;
-	for (i = 0; i < inbQ_num; i++) {
+	for (i = 0; i < pm8001_ha->inbnd_q_num; i++) {
 		u32 offset = i * 0x20;
 		pm8001_ha->inbnd_q_tbl[i].pi_pci_bar =
 		      get_pci_bar_index(pm8001_mr32(address, (offset + 0x14)));
@@ -156,10 +158,9 @@ read_inbnd_queue_table(struct pm8001_hba_info *pm8001_ha)
 static void
 read_outbnd_queue_table(struct pm8001_hba_info *pm8001_ha)
 {
-	int outbQ_num = 1;
 	int i;
 	void __iomem *address = pm8001_ha->outbnd_q_tbl_addr;
-	for (i = 0; i < outbQ_num; i++) {
+	for (i = 0; i < pm8001_ha->outbnd_q_num; i++) {
 		u32 offset = i * 0x24;
 		pm8001_ha->outbnd_q_tbl[i].ci_pci_bar =
 		      get_pci_bar_index(pm8001_mr32(address, (offset + 0x14)));
@@ -175,9 +176,9 @@ read_outbnd_queue_table(struct pm8001_hba_info *pm8001_ha)
 static void
 init_default_table_values(struct pm8001_hba_info *pm8001_ha)
 {
-	int qn = 1;
 	int i;
 	u32 offsetib, offsetob;
+	u64 ib_phys, ci_phys, ob_phys, pi_phys;
 	void __iomem *addressib = pm8001_ha->inbnd_q_tbl_addr;
 	void __iomem *addressob = pm8001_ha->outbnd_q_tbl_addr;
 
@@ -210,23 +211,30 @@ init_default_table_values(struct pm8001_hba_info *pm8001_ha)
 	pm8001_ha->main_cfg_tbl.iop_event_log_option		=
 		pm8001_ha->logging_option;
 	pm8001_ha->main_cfg_tbl.fatal_err_interrupt		= 0x01;
-	for (i = 0; i < qn; i++) {
+	/* the IB and CI regions are shared out evenly between the queues */
+	ib_phys = ((u64)pm8001_ha->memoryMap.region[IB].phys_addr_hi << 32) |
+		pm8001_ha->memoryMap.region[IB].phys_addr_lo;
+	ci_phys = ((u64)pm8001_ha->memoryMap.region[CI].phys_addr_hi << 32) |
+		pm8001_ha->memoryMap.region[CI].phys_addr_lo;
+	for (i = 0; i < pm8001_ha->inbnd_q_num; i++) {
+		u32 ib_len = pm8001_ha->mpi_queue_depth * 64;
 		pm8001_ha->inbnd_q_tbl[i].element_pri_size_cnt	=
-			PM8001_MPI_QUEUE | (64 << 16) | (0x00<<30);
+			pm8001_ha->mpi_queue_depth | (64 << 16) |
+			((i == PM8001_HIPRI_IQ) ? (0x01<<30) : (0x00<<30));
 		pm8001_ha->inbnd_q_tbl[i].upper_base_addr	=
-			pm8001_ha->memoryMap.region[IB].phys_addr_hi;
+			upper_32_bits(ib_phys + i * ib_len);
 		pm8001_ha->inbnd_q_tbl[i].lower_base_addr	=
-		pm8001_ha->memoryMap.region[IB].phys_addr_lo;
+			lower_32_bits(ib_phys + i * ib_len);
 		pm8001_ha->inbnd_q_tbl[i].base_virt		=
-			(u8 *)pm8001_ha->memoryMap.region[IB].virt_ptr;
-		pm8001_ha->inbnd_q_tbl[i].total_length		=
-			pm8001_ha->memoryMap.region[IB].total_len;
+			(u8 *)pm8001_ha->memoryMap.region[IB].virt_ptr +
+			i * ib_len;
+		pm8001_ha->inbnd_q_tbl[i].total_length		= ib_len;
 		pm8001_ha->inbnd_q_tbl[i].ci_upper_base_addr	=
-			pm8001_ha->memoryMap.region[CI].phys_addr_hi;
+			upper_32_bits(ci_phys + i * 4);
 		pm8001_ha->inbnd_q_tbl[i].ci_lower_base_addr	=
-			pm8001_ha->memoryMap.region[CI].phys_addr_lo;
+			lower_32_bits(ci_phys + i * 4);
 		pm8001_ha->inbnd_q_tbl[i].ci_virt		=
-			pm8001_ha->memoryMap.region[CI].virt_ptr;
+			(u8 *)pm8001_ha->memoryMap.region[CI].virt_ptr + i * 4;
 		offsetib = i * 0x20;
 		pm8001_ha->inbnd_q_tbl[i].pi_pci_bar		=
 			get_pci_bar_index(pm8001_mr32(addressib,
@@ -235,26 +243,47 @@ init_default_table_values(struct pm8001_hba_info *pm8001_ha)
 			pm8001_mr32(addressib, (offsetib + 0x18));
 		pm8001_ha->inbnd_q_tbl[i].producer_idx		= 0;
 		pm8001_ha->inbnd_q_tbl[i].consumer_index	= 0;
-	}
-	for (i = 0; i < qn; i++) {
+		/* one slot always stays empty to tell full from empty */
+		pm8001_ha->inbnd_q_tbl[i].free_slots		=
+			pm8001_ha->mpi_queue_depth - 1;
+	}
+	/* likewise OB and PI, and each outbound queue gets its own vector */
+	ob_phys = ((u64)pm8001_ha->memoryMap.region[OB].phys_addr_hi << 32) |
+		pm8001_ha->memoryMap.region[OB].phys_addr_lo;
+	pi_phys = ((u64)pm8001_ha->memoryMap.region[PI].phys_addr_hi << 32) |
+		pm8001_ha->memoryMap.region[PI].phys_addr_lo;
+	for (i = 0; i < pm8001_ha->outbnd_q_num; i++) {
+		u32 ob_len = pm8001_ha->mpi_queue_depth * 64;
 		pm8001_ha->outbnd_q_tbl[i].element_size_cnt	=
-			PM8001_MPI_QUEUE | (64 << 16) | (0x01<<30);
+			pm8001_ha->mpi_queue_depth | (64 << 16) | (0x01<<30);
 		pm8001_ha->outbnd_q_tbl[i].upper_base_addr	=
-			pm8001_ha->memoryMap.region[OB].phys_addr_hi;
+			upper_32_bits(ob_phys + i * ob_len);
 		pm8001_ha->outbnd_q_tbl[i].lower_base_addr	=
-			pm8001_ha->memoryMap.region[OB].phys_addr_lo;
+			lower_32_bits(ob_phys + i * ob_len);
 		pm8001_ha->outbnd_q_tbl[i].base_virt		=
-			(u8 *)pm8001_ha->memoryMap.region[OB].virt_ptr;
-		pm8001_ha->outbnd_q_tbl[i].total_length		=
-			pm8001_ha->memoryMap.region[OB].total_len;
+			(u8 *)pm8001_ha->memoryMap.region[OB].virt_ptr +
+			i * ob_len;
+		pm8001_ha->outbnd_q_tbl[i].total_length		= ob_len;
 		pm8001_ha->outbnd_q_tbl[i].pi_upper_base_addr	=
-			pm8001_ha->memoryMap.region[PI].phys_addr_hi;
+			upper_32_bits(pi_phys + i * 4);
 		pm8001_ha->outbnd_q_tbl[i].pi_lower_base_addr	=
-			pm8001_ha->memoryMap.region[PI].phys_addr_lo;
+			lower_32_bits(pi_phys + i * 4);
+		if (!pm8001_ha->coal_adaptive) {
+			pm8001_ha->outbnd_q_tbl[i].coal_count	=
+				pm8001_ha->coal_count;
+			pm8001_ha->outbnd_q_tbl[i].coal_delay	=
+				pm8001_ha->coal_delay;
+		} else {
+			pm8001_ha->outbnd_q_tbl[i].coal_count	= 0;
+			pm8001_ha->outbnd_q_tbl[i].coal_delay	= 0;
+		}
+		pm8001_ha->outbnd_q_tbl[i].coal_next		= jiffies;
 		pm8001_ha->outbnd_q_tbl[i].interrup_vec_cnt_delay	=
-			0 | (10 << 16) | (0 << 24);
+			pm8001_ha->outbnd_q_tbl[i].coal_delay |
+			(pm8001_ha->outbnd_q_tbl[i].coal_count << 16) |
+			(i << 24);
 		pm8001_ha->outbnd_q_tbl[i].pi_virt		=
-			pm8001_ha->memoryMap.region[PI].virt_ptr;
+			(u8 *)pm8001_ha->memoryMap.region[PI].virt_ptr + i * 4;
 		offsetob = i * 0x24;
 		pm8001_ha->outbnd_q_tbl[i].ci_pci_bar		=
 			get_pci_bar_index(pm8001_mr32(addressob,
@@ -262,6 +291,7 @@ init_default_table_values(struct pm8001_hba_info *pm8001_ha)
 		pm8001_ha->outbnd_q_tbl[i].ci_offset		=
 			pm8001_mr32(addressob, (offsetob + 0x18));
 		pm8001_ha->outbnd_q_tbl[i].consumer_idx		= 0;
+		pm8001_ha->outbnd_q_tbl[i].ci_published		= 0;
 		pm8001_ha->outbnd_q_tbl[i].producer_index	= 0;
 	}
 }
@@ -1634,6 +1664,107 @@ update_outbnd_queue_table(struct pm8001_hba_info *pm8001_ha, int number)
 		pm8001_ha->outbnd_q_tbl[number].interrup_vec_cnt_delay);
 }
 
+/**
+ * mpi_table_update - have the running firmware reload the config tables
+ * @pm8001_ha: our hba card information
+ *
+ * The same doorbell handshake as mpi_init_check, but sleeping between
+ * polls, so process context only.  Fails unless the firmware acks and
+ * the MPI state still reads initialized without error afterwards.
+ */
+static int mpi_table_update(struct pm8001_hba_info *pm8001_ha)
+{
+	unsigned long end = jiffies + HZ;
+	u32 gst_len_mpistate;
+
+	pm8001_cw32(pm8001_ha, 0, MSGU_IBDB_SET, SPC_MSGU_CFG_TABLE_UPDATE);
+	while (pm8001_cr32(pm8001_ha, 0, MSGU_IBDB_SET) &
+	       SPC_MSGU_CFG_TABLE_UPDATE) {
+		if (time_after(jiffies, end))
+			return -ETIMEDOUT;
+		msleep(1);
+	}
+	gst_len_mpistate = pm8001_mr32(pm8001_ha->general_stat_tbl_addr,
+		GST_GSTLEN_MPIS_OFFSET);
+	if (((gst_len_mpistate & GST_MPI_STATE_MASK) != GST_MPI_STATE_INIT) ||
+	    (gst_len_mpistate >> 16))
+		return -EIO;
+	return 0;
+}
+
+/**
+ * pm8001_set_coalesce - change one outbound queue's interrupt coalescing
+ * @pm8001_ha: our hba card information
+ * @number: the outbound queue
+ * @count: raise the interrupt once this many IOMBs are posted
+ * @delay: or once the oldest has waited this many usec
+ *
+ * Rewrites the queue's entry in the live config table and rings the
+ * table update doorbell so the firmware takes it.  Sleeps; never call it
+ * from a drain.  If the firmware does not take the new values, the queue
+ * keeps its old ones.
+ */
+int pm8001_set_coalesce(struct pm8001_hba_info *pm8001_ha, u32 number,
+	u32 count, u32 delay)
+{
+	struct outbound_queue_table *circularQ =
+		&pm8001_ha->outbnd_q_tbl[number];
+	u32 offset = number * 0x24 + 0x1C, value, old;
+	int rc = 0;
+
+	count = min_t(u32, count, PM8001_COAL_COUNT_MAX);
+	delay = min_t(u32, delay, PM8001_COAL_DELAY_MAX);
+	value = delay | (count << 16) | (number << 24);
+	mutex_lock(&pm8001_ha->coal_mutex);
+	old = circularQ->interrup_vec_cnt_delay;
+	if (value == old)
+		goto out;
+	pm8001_mw32(pm8001_ha->outbnd_q_tbl_addr, offset, value);
+	rc = mpi_table_update(pm8001_ha);
+	if (!rc && (pm8001_mr32(pm8001_ha->outbnd_q_tbl_addr, offset) != value))
+		rc = -EIO;
+	if (rc) {
+		pm8001_mw32(pm8001_ha->outbnd_q_tbl_addr, offset, old);
+		PM8001_FAIL_DBG(pm8001_ha,
+			pm8001_printk("oq%u coalescing update failed rc=%d\n",
+			number, rc));
+		goto out;
+	}
+	circularQ->coal_count = count;
+	circularQ->coal_delay = delay;
+	circularQ->interrup_vec_cnt_delay = value;
+out:
+	mutex_unlock(&pm8001_ha->coal_mutex);
+	return rc;
+}
+
+/* apply what pm8001_coalesce_adapt decided, outside the drain */
+static void pm8001_coalesce_work(PMCS_WORK_ARG work)
+{
+	struct pm8001_hba_info *pm8001_ha =
+		container_of(work, struct pm8001_hba_info, coal_work);
+	u32 vec, want;
+
+	for (vec = 0; vec < pm8001_ha->outbnd_q_num; vec++) {
+		if (!test_and_clear_bit(vec, &pm8001_ha->coal_dirty))
+			continue;
+		want = ACCESS_ONCE(pm8001_ha->outbnd_q_tbl[vec].coal_want);
+		if (pm8001_set_coalesce(pm8001_ha, vec, want >> 16,
+				want & 0xffff)) {
+			/* no point retrying every interval */
+			pm8001_ha->coal_adaptive = 0;
+			break;
+		}
+	}
+}
+
+void pm8001_coalesce_init(struct pm8001_hba_info *pm8001_ha)
+{
+	mutex_init(&pm8001_ha->coal_mutex);
+	pm8001_ha->coal_dirty = 0;
+	INIT_WORK(&pm8001_ha->coal_work, pm8001_coalesce_work);
+}
+
 /**
  * pm8001_bar4_shift - function is called to shift BAR base address
  * @pm8001_ha : our hba card infomation
@@ -2464,6 +2595,8 @@ static void pm8001_chip_interrupt_disable(struct pm8001_hba_info *pm8001_ha);
  */
 static int pm8001_chip_init(struct pm8001_hba_info *pm8001_ha)
 {
+	int i;
+
 	/* check the firmware status */
 	if ((pm8001_ha->rst_signature != SPC_HDASOFT_RESET_SIGNATURE)
 	 && (-1 == check_fw_ready(pm8001_ha))) {
@@ -2489,8 +2622,10 @@ static int pm8001_chip_init(struct pm8001_hba_info *pm8001_ha)
 	read_outbnd_queue_table(pm8001_ha);
 	/* update main config table ,inbound table and outbound table */
 	pm8001_update_main_config_table(pm8001_ha);
-	update_inbnd_queue_table(pm8001_ha, 0);
-	update_outbnd_queue_table(pm8001_ha, 0);
+	for (i = 0; i < pm8001_ha->inbnd_q_num; i++)
+		update_inbnd_queue_table(pm8001_ha, i);
+	for (i = 0; i < pm8001_ha->outbnd_q_num; i++)
+		update_outbnd_queue_table(pm8001_ha, i);
 	mpi_set_phys_g3_with_ssc(pm8001_ha, 0);
 	/* 7->130ms, 34->500ms, 119->1.5s */
 	mpi_set_open_retry_interval_reg(pm8001_ha, 119);
@@ -3100,7 +3235,10 @@ static void
 pm8001_chip_interrupt_enable(struct pm8001_hba_info *pm8001_ha)
 {
 #ifdef PM8001_USE_MSIX
-	pm8001_chip_msix_interrupt_enable(pm8001_ha, 0);
+	u32 vec;
+
+	for (vec = 0; vec < pm8001_ha->outbnd_q_num; vec++)
+		pm8001_chip_msix_interrupt_enable(pm8001_ha, vec);
 #else
 	pm8001_chip_intx_interrupt_enable(pm8001_ha);
 #endif
@@ -3114,7 +3252,10 @@ static void
 pm8001_chip_interrupt_disable(struct pm8001_hba_info *pm8001_ha)
 {
 #ifdef PM8001_USE_MSIX
-	pm8001_chip_msix_interrupt_disable(pm8001_ha, 0);
+	u32 vec;
+
+	for (vec = 0; vec < pm8001_ha->outbnd_q_num; vec++)
+		pm8001_chip_msix_interrupt_disable(pm8001_ha, vec);
 #else
 	pm8001_chip_intx_interrupt_disable(pm8001_ha);
 #endif
@@ -3122,11 +3263,13 @@ pm8001_chip_interrupt_disable(struct pm8001_hba_info *pm8001_ha)
 
 /**
  * mpi_msg_free_get- get the free message buffer for transfer inbound queue.
+ * @pm8001_ha: our hba card information
  * @circularQ: the inbound queue  we want to transfer to HBA.
  * @messageSize: the message size of this transfer, normally it is 64 bytes
  * @messagePtr: the pointer to message.
  */
-static int mpi_msg_free_get(struct inbound_queue_table *circularQ,
+static int mpi_msg_free_get(struct pm8001_hba_info *pm8001_ha,
+			    struct inbound_queue_table *circularQ,
 			    u16 messageSize, void **messagePtr)
 {
 	u32 offset, consumer_index;
@@ -3139,19 +3282,27 @@ static int mpi_msg_free_get(struct inbound_queue_table *circularQ,
 		return -1;
 	}
 
-	/* Stores the new consumer index */
-	consumer_index = pm8001_read_32(circularQ->ci_virt);
-	circularQ->consumer_index = cpu_to_le32(consumer_index);
-	if (((circularQ->producer_idx + bcCount) % PM8001_MPI_QUEUE) ==
-		le32_to_cpu(circularQ->consumer_index)) {
-		*messagePtr = NULL;
-		return -1;
+	/*
+	 * Only go to the firmware's consumer index, DMAed into host memory,
+	 * when what we already know is free cannot hold this message.
+	 */
+	if (circularQ->free_slots < bcCount) {
+		consumer_index = pm8001_read_32(circularQ->ci_virt);
+		circularQ->consumer_index = cpu_to_le32(consumer_index);
+		circularQ->free_slots = (consumer_index -
+			circularQ->producer_idx - 1) & pm8001_ha->mpi_queue_mask;
+		circularQ->ci_reads++;
+		if (circularQ->free_slots < bcCount) {
+			*messagePtr = NULL;
+			return -1;
+		}
 	}
+	circularQ->free_slots -= bcCount;
 	/* get memory IOMB buffer address */
 	offset = circularQ->producer_idx * 64;
 	/* increment to next bcCount element */
 	circularQ->producer_idx = (circularQ->producer_idx + bcCount)
-				% PM8001_MPI_QUEUE;
+				& pm8001_ha->mpi_queue_mask;
 	/* Adds that distance to the base of the region virtual address plus
 	the message header size*/
 	msgHeader = (struct mpi_msg_hdr *)(circularQ->base_virt	+ offset);
@@ -3160,26 +3311,121 @@ static int mpi_msg_free_get(struct inbound_queue_table *circularQ,
 }
 
 /**
- * mpi_build_cmd- build the message queue for transfer, update the PI to FW
- * to tell the fw to get this message from IOMB.
+ * pm8001_inbnd_q_select - pick the inbound queue for the submitting cpu.
+ * @pm8001_ha: our hba card information
+ *
+ * Each cpu posts to its own queue so that submitters do not share a
+ * producer index; the queue's iq_lock covers cpus that alias onto it.
+ */
+static inline struct inbound_queue_table *
+pm8001_inbnd_q_select(struct pm8001_hba_info *pm8001_ha)
+{
+	return &pm8001_ha->inbnd_q_tbl[PM8001_HIPRI_IQ + 1 +
+		raw_smp_processor_id() % (pm8001_ha->inbnd_q_num - 1)];
+}
+
+/**
+ * pm8001_inbnd_q_hipri - the inbound queue for aborts, TMFs, SMP and
+ * device (de)registration.
+ * @pm8001_ha: our hba card information
+ *
+ * The firmware services it ahead of the I/O queues, so error recovery and
+ * discovery are not stuck behind a full ring of data commands.
+ */
+static inline struct inbound_queue_table *
+pm8001_inbnd_q_hipri(struct pm8001_hba_info *pm8001_ha)
+{
+	return &pm8001_ha->inbnd_q_tbl[PM8001_HIPRI_IQ];
+}
+
+/**
+ * pm8001_iq_ring - tell the firmware about everything posted on a queue.
+ * @pm8001_ha: our hba card information
+ * @circularQ: the inbound queue, iq_lock held
+ */
+static inline void pm8001_iq_ring(struct pm8001_hba_info *pm8001_ha,
+	struct inbound_queue_table *circularQ)
+{
+	pm8001_cw32(pm8001_ha, circularQ->pi_pci_bar,
+		circularQ->pi_offset, circularQ->producer_idx);
+	circularQ->db_pending = 0;
+	circularQ->db_rung++;
+}
+
+/**
+ * pm8001_chip_iq_plug - open a submission batch on this cpu's queue.
+ * @pm8001_ha: our hba card information
+ * @plug: the batch, on the caller's stack
+ *
+ * Commands built with @plug all post to the queue chosen here, wherever
+ * the submitter runs by then, and leave the PI doorbell alone for up to
+ * db_batch IOMBs.  Only this submitter's IOMBs wait for the doorbell;
+ * anyone else posting to the queue rings it as usual, which publishes
+ * the batch's IOMBs along with their own.
+ */
+static void pm8001_chip_iq_plug(struct pm8001_hba_info *pm8001_ha,
+	struct pm8001_iq_plug *plug)
+{
+	plug->circularQ = pm8001_inbnd_q_select(pm8001_ha);
+	plug->pending = 0;
+}
+
+/**
+ * pm8001_chip_iq_unplug - close a batch and ring whatever is left.
+ * @pm8001_ha: our hba card information
+ * @plug: the batch pm8001_chip_iq_plug opened
+ */
+static void pm8001_chip_iq_unplug(struct pm8001_hba_info *pm8001_ha,
+	struct pm8001_iq_plug *plug)
+{
+	struct inbound_queue_table *circularQ = plug->circularQ;
+	unsigned long flags;
+
+	if (!plug->pending)
+		return;
+	spin_lock_irqsave(&circularQ->iq_lock, flags);
+	/* someone else may have rung it since */
+	if (circularQ->db_pending)
+		pm8001_iq_ring(pm8001_ha, circularQ);
+	spin_unlock_irqrestore(&circularQ->iq_lock, flags);
+	plug->pending = 0;
+}
+
+/**
+ * mpi_build_cmd_plug - build the message queue for transfer, update the
+ * PI to FW unless the submitter's batch holds it back.
  * @pm8001_ha: our hba card information
  * @circularQ: the inbound queue we want to transfer to HBA.
  * @opCode: the operation code represents commands which LLDD and fw recognized.
  * @payload: the command payload of each operation command.
+ * @plug: the submitter's open batch, or NULL to ring the doorbell now
  */
-static int mpi_build_cmd(struct pm8001_hba_info *pm8001_ha,
+static int mpi_build_cmd_plug(struct pm8001_hba_info *pm8001_ha,
 			 int tag,
 			 struct inbound_queue_table *circularQ,
-			 u32 opCode, void *payload)
+			 u32 opCode, void *payload,
+			 struct pm8001_iq_plug *plug)
 {
 	struct pm8001_ccb_info *ccb = get_ccb_array(pm8001_ha, tag);
 	u32 Header = 0, hpriority = 0, bc = 1, category = 0x02;
-	u32 responseQueue = 0;
+	u32 responseQueue;
 	void *pMessage;
+	unsigned long flags;
 
 	BUG_ON(ccb->ccb_tag != tag);
-
-	if (mpi_msg_free_get(circularQ, 64, &pMessage) < 0) {
+	if (circularQ == pm8001_inbnd_q_hipri(pm8001_ha))
+		hpriority = 1;
+	/* answer on the outbound queue whose vector is bound to this cpu */
+	responseQueue = *per_cpu_ptr(pm8001_ha->cpu_oq, raw_smp_processor_id());
+	ccb->oq = responseQueue;
+
+	local_irq_save(flags);
+	pm8001_spin_lock_counted(&circularQ->iq_lock, &circularQ->iq_contended);
+	if (mpi_msg_free_get(pm8001_ha, circularQ, 64, &pMessage) < 0) {
+		/* let the firmware drain what a batch is holding back */
+		if (circularQ->db_pending)
+			pm8001_iq_ring(pm8001_ha, circularQ);
+		spin_unlock_irqrestore(&circularQ->iq_lock, flags);
 		PM8001_FAIL_DBG(pm8001_ha,
 			pm8001_printk("No free mpi buffer\n"));
 		return -ENOMEM;
@@ -3194,16 +3440,63 @@ static int mpi_build_cmd(struct pm8001_hba_info *pm8001_ha,
 		| ((category & 0xF) << 12) | (opCode & 0xFFF));
 
 	ccb->opCode = cpu_to_le32(Header);
+	/* pm8001_lock_all holders see it only once it is really posted */
+	if (ccb->track) {
+		ccb->track = 0;
+		pm8001_ccb_link(ccb);
+	}
 	pm8001_write_32((pMessage - 4), 0, cpu_to_le32(Header));
-	/*Update the PI to the firmware*/
-	pm8001_cw32(pm8001_ha, circularQ->pi_pci_bar,
-		circularQ->pi_offset, circularQ->producer_idx);
+	circularQ->iomb_posted++;
+	/*Update the PI to the firmware, unless our batch holds it back*/
+	circularQ->db_pending++;
+	if (!plug || (++plug->pending >= pm8001_ha->db_batch)) {
+		pm8001_iq_ring(pm8001_ha, circularQ);
+		if (plug)
+			plug->pending = 0;
+	}
 	PM8001_MSG_DBG2(pm8001_ha,
 		pm8001_printk("after PI= %d CI= %d\n", circularQ->producer_idx,
 		circularQ->consumer_index));
+	spin_unlock_irqrestore(&circularQ->iq_lock, flags);
 	return 0;
 }
 
+/**
+ * mpi_build_cmd- build the message queue for transfer, update the PI to FW
+ * to tell the fw to get this message from IOMB.
+ * @pm8001_ha: our hba card information
+ * @circularQ: the inbound queue we want to transfer to HBA.
+ * @opCode: the operation code represents commands which LLDD and fw recognized.
+ * @payload: the command payload of each operation command.
+ */
+static int mpi_build_cmd(struct pm8001_hba_info *pm8001_ha,
+			 int tag,
+			 struct inbound_queue_table *circularQ,
+			 u32 opCode, void *payload)
+{
+	return mpi_build_cmd_plug(pm8001_ha, tag, circularQ, opCode, payload,
+		NULL);
+}
+
+/**
+ * mpi_msg_ci_publish - tell the chip how far an outbound queue is consumed
+ * @pm8001_ha: our hba card information
+ * @circularQ: the outbound queue, oq_lock held
+ *
+ * Consuming an IOMB only moves our copy of the consumer index; this
+ * writes it out, once per batch rather than once per IOMB.
+ */
+static void mpi_msg_ci_publish(struct pm8001_hba_info *pm8001_ha,
+	struct outbound_queue_table *circularQ)
+{
+	if (circularQ->ci_published == circularQ->consumer_idx)
+		return;
+	pm8001_cw32(pm8001_ha, circularQ->ci_pci_bar, circularQ->ci_offset,
+		circularQ->consumer_idx);
+	circularQ->ci_published = circularQ->consumer_idx;
+	circularQ->ci_writes++;
+}
+
 static u32 mpi_msg_free_set(struct pm8001_hba_info *pm8001_ha, void *pMsg,
 			    struct outbound_queue_table *circularQ, u8 bc)
 {
@@ -3230,13 +3523,8 @@ static u32 mpi_msg_free_set(struct pm8001_hba_info *pm8001_ha, void *pMsg,
 	}
 	/* free the circular queue buffer elements associated with the message*/
 	circularQ->consumer_idx = (circularQ->consumer_idx + bc)
-				% PM8001_MPI_QUEUE;
-	/* update the CI of outbound queue */
-	pm8001_cw32(pm8001_ha, circularQ->ci_pci_bar, circularQ->ci_offset,
-		circularQ->consumer_idx);
-	/* Update the producer index from SPC*/
-	producer_index = pm8001_read_32(circularQ->pi_virt);
-	circularQ->producer_index = cpu_to_le32(producer_index);
+				& pm8001_ha->mpi_queue_mask;
+	/* the CI reaches the chip in mpi_msg_ci_publish */
 	PM8001_MSG_DBG2(pm8001_ha,
 		pm8001_printk(" CI=%d PI=%d\n", circularQ->consumer_idx,
 		circularQ->producer_index));
@@ -3288,26 +3576,17 @@ static u32 mpi_msg_consume(struct pm8001_hba_info *pm8001_ha,
 						(circularQ->consumer_idx +
 						((le32_to_cpu(msgHeader_tmp)
 						 >> 24) & 0x1f))
-							% PM8001_MPI_QUEUE;
+							& pm8001_ha->mpi_queue_mask;
 					msgHeader_tmp = 0;
 					pm8001_write_32(msgHeader, 0, 0);
-					/* update the CI of outbound queue */
-					pm8001_cw32(pm8001_ha,
-						circularQ->ci_pci_bar,
-						circularQ->ci_offset,
-						circularQ->consumer_idx);
 				}
 			} else {
 				circularQ->consumer_idx =
 					(circularQ->consumer_idx +
 					((le32_to_cpu(msgHeader_tmp) >> 24) &
-					0x1f)) % PM8001_MPI_QUEUE;
+					0x1f)) & pm8001_ha->mpi_queue_mask;
 				msgHeader_tmp = 0;
 				pm8001_write_32(msgHeader, 0, 0);
-				/* update the CI of outbound queue */
-				pm8001_cw32(pm8001_ha, circularQ->ci_pci_bar,
-					circularQ->ci_offset,
-					circularQ->consumer_idx);
 				return MPI_IO_STATUS_FAIL;
 			}
 		} else {
@@ -3324,6 +3603,430 @@ static u32 mpi_msg_consume(struct pm8001_hba_info *pm8001_ha,
 	return MPI_IO_STATUS_BUSY;
 }
 
+/**
+ * pm8001_work_get - take a work item from the hba's pool
+ * @pm8001_ha: our hba card information
+ *
+ * Lock free: a set bit in work_map owns the slot.  Falls back to an atomic
+ * allocation when the pool is used up, so recovery is never dropped for it.
+ */
+static struct pm8001_work *pm8001_work_get(struct pm8001_hba_info *pm8001_ha)
+{
+	u32 i, busy, high;
+
+	for (;;) {
+		i = find_first_zero_bit(pm8001_ha->work_map,
+			pm8001_ha->work_num);
+		if (i >= pm8001_ha->work_num)
+			break;
+		if (test_and_set_bit(i, pm8001_ha->work_map))
+			continue;
+		busy = atomic_inc_return(&pm8001_ha->work_busy);
+		/* every completion vector gets here; only ever raise it */
+		do {
+			high = ACCESS_ONCE(pm8001_ha->work_high);
+		} while ((busy > high) &&
+		    (cmpxchg(&pm8001_ha->work_high, high, busy) != high));
+		return &pm8001_ha->work_pool[i];
+	}
+	atomic_inc(&pm8001_ha->work_exhausted);
+	return PMALLOC(sizeof(struct pm8001_work), GFP_ATOMIC);
+}
+
+/**
+ * pm8001_work_put - hand a work item back
+ * @pm8001_ha: our hba card information
+ * @pw: from pm8001_work_get
+ */
+static void pm8001_work_put(struct pm8001_hba_info *pm8001_ha,
+	struct pm8001_work *pw)
+{
+	if ((pw < pm8001_ha->work_pool) ||
+	    (pw >= pm8001_ha->work_pool + pm8001_ha->work_num)) {
+		PMFREE(pw, sizeof(*pw));
+		return;
+	}
+	atomic_dec(&pm8001_ha->work_busy);
+	smp_mb__before_clear_bit();
+	clear_bit(pw - pm8001_ha->work_pool, pm8001_ha->work_map);
+}
+
+static void pm8001_work_fn(PMCS_WORK_ARG work);
+
+/*
+ * Open reject backoff.  A device that keeps rejecting gets its retries held
+ * back, the delay doubling from PM8001_OREJ_MIN_MS up to PM8001_OREJ_MAX_MS
+ * while the rejects keep coming.  Held work items sit on one per-hba timer
+ * wheel, a slot per jiffy, and are requeued when their slot comes round.
+ */
+static void pm8001_orej_timer(unsigned long data)
+{
+	struct pm8001_hba_info *pm8001_ha = (struct pm8001_hba_info *)data;
+	struct pm8001_work *pw, *n;
+	unsigned long flags;
+	LIST_HEAD(due);
+	u32 slots = 0;
+
+	spin_lock_irqsave(&pm8001_ha->orej_lock, flags);
+	while (time_before_eq(pm8001_ha->orej_next, jiffies) &&
+	    (slots++ < PM8001_OREJ_SLOTS)) {
+		list_splice_init(&pm8001_ha->orej_wheel[pm8001_ha->orej_next %
+			PM8001_OREJ_SLOTS], &due);
+		pm8001_ha->orej_next++;
+	}
+	list_for_each_entry(pw, &due, wheel)
+		pm8001_ha->orej_pending--;
+	if (pm8001_ha->orej_pending)
+		mod_timer(&pm8001_ha->orej_timer, pm8001_ha->orej_next);
+	spin_unlock_irqrestore(&pm8001_ha->orej_lock, flags);
+	list_for_each_entry_safe(pw, n, &due, wheel) {
+		list_del_init(&pw->wheel);
+		queue_work(pm8001_wq, &pw->work);
+	}
+}
+
+void pm8001_orej_init(struct pm8001_hba_info *pm8001_ha)
+{
+	u32 i;
+
+	spin_lock_init(&pm8001_ha->orej_lock);
+	for (i = 0; i < PM8001_OREJ_SLOTS; i++)
+		INIT_LIST_HEAD(&pm8001_ha->orej_wheel[i]);
+	setup_timer(&pm8001_ha->orej_timer, pm8001_orej_timer,
+		(unsigned long)pm8001_ha);
+}
+
+/* drop whatever is still held, the hba is going away */
+void pm8001_orej_stop(struct pm8001_hba_info *pm8001_ha)
+{
+	struct pm8001_work *pw, *n;
+	unsigned long flags;
+	LIST_HEAD(held);
+	u32 i;
+
+	del_timer_sync(&pm8001_ha->orej_timer);
+	spin_lock_irqsave(&pm8001_ha->orej_lock, flags);
+	for (i = 0; i < PM8001_OREJ_SLOTS; i++)
+		list_splice_init(&pm8001_ha->orej_wheel[i], &held);
+	pm8001_ha->orej_pending = 0;
+	spin_unlock_irqrestore(&pm8001_ha->orej_lock, flags);
+	list_for_each_entry_safe(pw, n, &held, wheel) {
+		list_del_init(&pw->wheel);
+		pm8001_work_put(pm8001_ha, pw);
+	}
+}
+
+/* drop a device's held retries, it is being freed */
+void pm8001_orej_drop(struct pm8001_hba_info *pm8001_ha,
+	struct pm8001_device *pm8001_dev)
+{
+	struct pm8001_work *pw, *n;
+	unsigned long flags;
+	u32 i;
+
+	spin_lock_irqsave(&pm8001_ha->orej_lock, flags);
+	for (i = 0; pm8001_ha->orej_pending && (i < PM8001_OREJ_SLOTS); i++) {
+		list_for_each_entry_safe(pw, n, &pm8001_ha->orej_wheel[i],
+		    wheel) {
+			if (pw->data != pm8001_dev)
+				continue;
+			list_del_init(&pw->wheel);
+			pm8001_ha->orej_pending--;
+			pm8001_work_put(pm8001_ha, pw);
+		}
+	}
+	spin_unlock_irqrestore(&pm8001_ha->orej_lock, flags);
+}
+
+/**
+ * pm8001_orej_delay - account a retry to a device and pick its delay
+ * @pm8001_ha: our hba card information
+ * @pm8001_dev: the rejecting device
+ *
+ * Returns the jiffies to hold the retry for, 0 to retry at once.  Called
+ * with orej_lock held.
+ */
+static unsigned long pm8001_orej_delay(struct pm8001_hba_info *pm8001_ha,
+	struct pm8001_device *pm8001_dev)
+{
+	unsigned long now = jiffies;
+	u32 backoff;
+
+	pm8001_dev->orej_retries++;
+	if (time_after_eq(now, pm8001_dev->orej_window_start + HZ)) {
+		pm8001_dev->orej_rate = time_before(now,
+			pm8001_dev->orej_window_start + 2 * HZ) ?
+			pm8001_dev->orej_window : 0;
+		pm8001_dev->orej_window = 0;
+		pm8001_dev->orej_window_start = now;
+	}
+	pm8001_dev->orej_window++;
+	if (pm8001_dev->orej_last && time_before(now, pm8001_dev->orej_last +
+	    msecs_to_jiffies(PM8001_OREJ_DECAY_MS)))
+		backoff = pm8001_dev->orej_backoff ?
+			min_t(u32, pm8001_dev->orej_backoff * 2,
+				PM8001_OREJ_MAX_MS) : PM8001_OREJ_MIN_MS;
+	else
+		backoff = 0;
+	pm8001_dev->orej_backoff = backoff;
+	pm8001_dev->orej_last = now;
+	if (!backoff || !pm8001_ha->orej_backoff_enable)
+		return 0;
+	/* half of it fixed, half random, so a wide port's retries spread */
+	backoff = backoff / 2 + random32() % (backoff / 2 + 1);
+	pm8001_dev->orej_held++;
+	return min_t(unsigned long, msecs_to_jiffies(backoff),
+		PM8001_OREJ_SLOTS - 1);
+}
+
+/**
+ * pm8001_orej_defer - hold an open reject retry back on the wheel
+ * @pm8001_ha: our hba card information
+ * @pw: the work item that got here, reused for the retry
+ * @t: the task to retry, NULL for all of the device's
+ * @tag: @t's ccb tag, to tell if it is still the same command later
+ * @pm8001_dev: the device
+ *
+ * Returns 1 if @pw is now owned by the wheel, 0 to retry right away.
+ */
+static int pm8001_orej_defer(struct pm8001_hba_info *pm8001_ha,
+	struct pm8001_work *pw, struct sas_task *t, u32 tag,
+	struct pm8001_device *pm8001_dev)
+{
+	unsigned long flags, delay, due;
+
+	spin_lock_irqsave(&pm8001_ha->orej_lock, flags);
+	delay = pm8001_orej_delay(pm8001_ha, pm8001_dev);
+	if (!delay) {
+		spin_unlock_irqrestore(&pm8001_ha->orej_lock, flags);
+		return 0;
+	}
+	pw->data = pm8001_dev;
+	pw->handler = PM8001_WORK_OREJ_RETRY;
+	pw->task = t;
+	pw->tag = tag;
+	pw->dev = pm8001_dev->sas_device;
+	INIT_WORK(&pw->work, pm8001_work_fn);
+	if (!pm8001_ha->orej_pending)
+		pm8001_ha->orej_next = jiffies;
+	due = jiffies + delay;
+	list_add_tail(&pw->wheel,
+		&pm8001_ha->orej_wheel[due % PM8001_OREJ_SLOTS]);
+	if (!pm8001_ha->orej_pending++ ||
+	    time_before(due, pm8001_ha->orej_timer.expires))
+		mod_timer(&pm8001_ha->orej_timer, due);
+	spin_unlock_irqrestore(&pm8001_ha->orej_lock, flags);
+	return 1;
+}
+
+/*
+ * The held retry is due; make sure it is still the device it was, in case
+ * the slot was freed and handed out again meanwhile, and the command.
+ */
+static void pm8001_orej_retry(struct pm8001_hba_info *pm8001_ha,
+	struct pm8001_work *pw, struct pm8001_device *pm8001_dev)
+{
+	struct sas_task *t = pw->task;
+	struct pm8001_ccb_info *ccb;
+	unsigned long flags;
+	int stale;
+
+	pm8001_lock_all(pm8001_ha, &flags);
+	stale = (pm8001_dev->sas_device != pw->dev);
+	if (t && !stale) {
+		ccb = get_ccb_array(pm8001_ha, pw->tag);
+		stale = (ccb->ccb_tag != pw->tag) || (ccb->task != t) ||
+			(ccb->device != pm8001_dev);
+	}
+	pm8001_unlock_all(pm8001_ha, flags);
+	if (stale)
+		return;
+	pm8001_open_reject_retry(pm8001_ha, t, pm8001_dev);
+}
+
+/*
+ * Stall detection.  A device's ccb_list is in submission order and each ccb
+ * carries its submit time, so the list doubles as the device's timeout
+ * queue: every tick looks at the oldest entries only and stops at the first
+ * one still inside the device's stall time.  A stalled command is handed
+ * to the midlayer's EH from the workqueue as if its own timeout had fired.
+ */
+
+/* the midlayer command behind a task, NULL for the driver's own */
+static struct scsi_cmnd *pm8001_stall_cmnd(struct sas_task *t)
+{
+	if (t->task_proto & SAS_PROTOCOL_SSP)
+		return t->uldd_task;
+	if (t->task_proto & SAS_PROTOCOL_STP_ALL)
+		return ((struct ata_queued_cmd *)t->uldd_task)->scsicmd;
+	return NULL;
+}
+
+/*
+ * Commands given a long timeout on purpose (format, sanitize) are exempt,
+ * and so are internal ones, which the midlayer has no request for.
+ */
+static int pm8001_stall_exempt(struct sas_task *t)
+{
+	struct scsi_cmnd *cmnd = pm8001_stall_cmnd(t);
+
+	return !cmnd || !cmnd->request ||
+		(cmnd->request->timeout > PM8001_STALL_CMD_MAX);
+}
+
+static void pm8001_stall_timer(unsigned long data)
+{
+	struct pm8001_hba_info *pm8001_ha = (struct pm8001_hba_info *)data;
+	struct pm8001_device *pm8001_dev;
+	struct pm8001_ccb_info *ccb;
+	struct pm8001_work *pw;
+	struct sas_task *found[PM8001_STALL_BATCH];
+	u32 tags[PM8001_STALL_BATCH];
+	unsigned long flags;
+	ktime_t now;
+	s64 age, limit;
+	u32 i, j, n, on = 1;
+
+	if (pm8001_ha->reset_active)
+		goto out;
+	/* new devices get the hba's stall time, so it keeps the scan going */
+	on = pm8001_ha->stall_ms;
+	now = ktime_get();
+	for (i = 0; i < PM8001_MAX_DEVICES; i++) {
+		pm8001_dev = &pm8001_ha->devices[i];
+		if ((pm8001_dev->dev_type == NO_DEVICE) ||
+		    !pm8001_dev->stall_ms)
+			continue;
+		on = 1;
+		if (!atomic_read(&pm8001_dev->running_req))
+			continue;
+		limit = (s64)pm8001_dev->stall_ms * USEC_PER_MSEC;
+		n = 0;
+		spin_lock_irqsave(&pm8001_dev->ccb_lock, flags);
+		list_for_each_entry(ccb, &pm8001_dev->ccb_list, dev_list) {
+			/* posted before the scan was turned on */
+			if (!ktime_to_ns(ccb->issued))
+				continue;
+			age = ktime_to_us(ktime_sub(now, ccb->issued));
+			if (age < limit)
+				break;	/* the rest are younger */
+			/* already with the midlayer */
+			if (ccb->stalled)
+				continue;
+			if (!ccb->task || !ccb->task->uldd_task ||
+			    pm8001_stall_exempt(ccb->task))
+				continue;
+			ccb->stalled = 1;
+			found[n] = ccb->task;
+			tags[n] = ccb->ccb_tag;
+			if (++n >= PM8001_STALL_BATCH)
+				break;
+		}
+		spin_unlock_irqrestore(&pm8001_dev->ccb_lock, flags);
+		for (j = 0; j < n; j++) {
+			PM8001_IO_DBG(pm8001_ha, pm8001_printk(
+				"device %x tag %x stalled\n",
+				pm8001_dev->device_id, tags[j]));
+			pm8001_dev->stuck++;
+			atomic_inc(&pm8001_ha->stall_flagged);
+			pw = pm8001_work_get(pm8001_ha);
+			if (!pw)
+				continue;
+			pw->pm8001_ha = pm8001_ha;
+			pw->data = pm8001_dev;
+			pw->handler = PM8001_WORK_STALL;
+			pw->task = found[j];
+			pw->tag = tags[j];
+			INIT_WORK(&pw->work, pm8001_work_fn);
+			queue_work(pm8001_wq, &pw->work);
+		}
+	}
+out:
+	/* nothing to watch; pm8001_stall_start() brings it back */
+	if (on)
+		mod_timer(&pm8001_ha->stall_timer,
+			jiffies + PM8001_STALL_TICK);
+}
+
+void pm8001_stall_init(struct pm8001_hba_info *pm8001_ha)
+{
+	setup_timer(&pm8001_ha->stall_timer, pm8001_stall_timer,
+		(unsigned long)pm8001_ha);
+}
+
+/* (re)arm the scan, once a stall time has been set */
+void pm8001_stall_start(struct pm8001_hba_info *pm8001_ha)
+{
+	if (!timer_pending(&pm8001_ha->stall_timer))
+		mod_timer(&pm8001_ha->stall_timer,
+			jiffies + PM8001_STALL_TICK);
+}
+
+void pm8001_stall_stop(struct pm8001_hba_info *pm8001_ha)
+{
+	del_timer_sync(&pm8001_ha->stall_timer);
+}
+
+/*
+ * The stalled command, if its ccb is still in flight for the task the scan
+ * flagged.  Under the device's ccb_lock, which keeps it that way: a ccb
+ * leaves the list before its task is completed.
+ */
+static struct scsi_cmnd *pm8001_stall_live(struct pm8001_hba_info *pm8001_ha,
+	struct pm8001_work *pw, struct pm8001_device *pm8001_dev)
+{
+	struct pm8001_ccb_info *ccb = get_ccb_array(pm8001_ha, pw->tag);
+
+	if ((ccb->ccb_tag != pw->tag) || (ccb->task != pw->task) ||
+	    (ccb->device != pm8001_dev) || !ccb->stalled ||
+	    list_empty(&ccb->dev_list))
+		return NULL;
+	return pm8001_stall_cmnd(ccb->task);
+}
+
+/*
+ * Recover a stalled command by timing it out early, so the midlayer's EH
+ * aborts and escalates it as it would at its own timeout, and nothing else
+ * runs recovery beside it.  The scsi_device reference keeps the request
+ * queue; the queue lock keeps the request from being ended and reused
+ * between the last look at the ccb and the abort.  A completion that gets
+ * in first makes blk_abort_request() a no-op.
+ */
+static void pm8001_stall_recover(struct pm8001_hba_info *pm8001_ha,
+	struct pm8001_work *pw, struct pm8001_device *pm8001_dev)
+{
+	struct scsi_device *sdev = NULL;
+	struct scsi_cmnd *cmnd;
+	struct request_queue *q;
+	struct request *rq = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&pm8001_dev->ccb_lock, flags);
+	cmnd = pm8001_stall_live(pm8001_ha, pw, pm8001_dev);
+	if (cmnd && !scsi_device_get(cmnd->device))
+		sdev = cmnd->device;
+	spin_unlock_irqrestore(&pm8001_dev->ccb_lock, flags);
+	if (!sdev)
+		return;
+
+	q = sdev->request_queue;
+	spin_lock_irqsave(q->queue_lock, flags);
+	spin_lock(&pm8001_dev->ccb_lock);
+	cmnd = pm8001_stall_live(pm8001_ha, pw, pm8001_dev);
+	if (cmnd)
+		rq = cmnd->request;
+	spin_unlock(&pm8001_dev->ccb_lock);
+	if (rq) {
+		PM8001_EH_DBG(pm8001_ha, pm8001_printk(
+			"device %x tag %x stalled, timing out\n",
+			pm8001_dev->device_id, pw->tag));
+		atomic_inc(&pm8001_ha->stall_timedout);
+		blk_abort_request(rq);
+	}
+	spin_unlock_irqrestore(q->queue_lock, flags);
+	scsi_device_put(sdev);
+}
+
 static void pm8001_work_fn(PMCS_WORK_ARG work)
 {
 	struct pm8001_work *pw = container_of(work, struct pm8001_work, work);
@@ -3340,7 +4043,7 @@ static void pm8001_work_fn(PMCS_WORK_ARG work)
 	if ((pm8001_dev == NULL)
 	 || ((pw->handler != IO_XFER_ERROR_BREAK)
 	  && (pm8001_dev->dev_type == NO_DEVICE))) {
-		PMFREE(pw, sizeof(*pw));
+		pm8001_work_put(pw->pm8001_ha, pw);
 		return;
 	}
 
@@ -3353,29 +4056,25 @@ static void pm8001_work_fn(PMCS_WORK_ARG work)
 		struct pm8001_hba_info *pm8001_ha = pw->pm8001_ha;
 		unsigned long flags, flags1;
 		struct task_status_struct *ts;
-		int i;
 
 		if (pm8001_query_task(t) == TMF_RESP_FUNC_SUCC)
 			break; /* Task still on lu */
-		spin_lock_irqsave(&pm8001_ha->lock, flags);
+		pm8001_lock_all(pm8001_ha, &flags);
 
 		spin_lock_irqsave(&t->task_state_lock, flags1);
 		if (unlikely((t->task_state_flags & SAS_TASK_STATE_DONE))) {
 			spin_unlock_irqrestore(&t->task_state_lock, flags1);
-			spin_unlock_irqrestore(&pm8001_ha->lock, flags);
+			pm8001_unlock_all(pm8001_ha, flags);
 			break; /* Task got completed by another */
 		}
 		spin_unlock_irqrestore(&t->task_state_lock, flags1);
 		
-		FOR_ALL_CCB(ccb) {
-				tag = ccb->ccb_tag;
-				if ((tag != 0xFFFFFFFF) && (ccb->task == t))
-					break;
-		}
+		ccb = pm8001_task_ccb(t);
 		if (!ccb) {
-			spin_unlock_irqrestore(&pm8001_ha->lock, flags);
+			pm8001_unlock_all(pm8001_ha, flags);
 			break; /* Task got freed by another */
 		}
+		tag = ccb->ccb_tag;
 		ts = &t->task_status;
 		ts->resp = SAS_TASK_COMPLETE;
 		/* Force the midlayer to retry */
@@ -3393,12 +4092,12 @@ static void pm8001_work_fn(PMCS_WORK_ARG work)
 				" aborted by upper layer!\n",
 				t, pw->handler, ts->resp, ts->stat));
 			pm8001_ccb_task_free(pm8001_ha, t, ccb, tag);
-			spin_unlock_irqrestore(&pm8001_ha->lock, flags);
+			pm8001_unlock_all(pm8001_ha, flags);
 		} else {
 			spin_unlock_irqrestore(&t->task_state_lock, flags1);
 			pm8001_ccb_task_free(pm8001_ha, t, ccb, tag);
 			mb();/* in order to force CPU ordering */
-			spin_unlock_irqrestore(&pm8001_ha->lock, flags);
+			pm8001_unlock_all(pm8001_ha, flags);
 			t->task_done(t);
 		}
 	}	break;
@@ -3407,11 +4106,11 @@ static void pm8001_work_fn(PMCS_WORK_ARG work)
 	case IO_XFER_ERROR_ACK_NAK_TIMEOUT:
 	{	/* This one stashes the sas_task instead */
 		struct sas_task *t = (struct sas_task *)pm8001_dev;
-		u32 tag;
 		struct pm8001_ccb_info *ccb;
 		struct pm8001_hba_info *pm8001_ha = pw->pm8001_ha;
 		unsigned long flags, flags1;
-		int i, ret;
+		int ret;
+		u32 tag;
 
 		ret = pm8001_query_task(t);
 
@@ -3430,26 +4129,22 @@ static void pm8001_work_fn(PMCS_WORK_ARG work)
 				break;
 			});
 
-		spin_lock_irqsave(&pm8001_ha->lock, flags);
+		pm8001_lock_all(pm8001_ha, &flags);
 
 		spin_lock_irqsave(&t->task_state_lock, flags1);
 
 		if (unlikely((t->task_state_flags & SAS_TASK_STATE_DONE))) {
 			spin_unlock_irqrestore(&t->task_state_lock, flags1);
-			spin_unlock_irqrestore(&pm8001_ha->lock, flags);
+			pm8001_unlock_all(pm8001_ha, flags);
 			if (ret == TMF_RESP_FUNC_SUCC) /* task on lu */
 				(void)pm8001_abort_task(t);
 			break; /* Task got completed by another */
 		}
 
 		spin_unlock_irqrestore(&t->task_state_lock, flags1);
-		FOR_ALL_CCB(ccb) {
-				tag = ccb->ccb_tag;
-				if ((tag != 0xFFFFFFFF) && (ccb->task == t))
-					break;
-		}
+		ccb = pm8001_task_ccb(t);
 		if (!ccb) {
-			spin_unlock_irqrestore(&pm8001_ha->lock, flags);
+			pm8001_unlock_all(pm8001_ha, flags);
 			if (ret == TMF_RESP_FUNC_SUCC) /* task on lu */
 				(void)pm8001_abort_task(t);
 			break; /* Task got freed by another */
@@ -3457,11 +4152,12 @@ static void pm8001_work_fn(PMCS_WORK_ARG work)
 
 		pm8001_dev = ccb->device;
 		dev = pm8001_dev->sas_device;
+		tag = ccb->ccb_tag;
 
 		switch (ret) {
 		case TMF_RESP_FUNC_SUCC: /* task on lu */
 			ccb->open_retry = 1; /* Snub completion */
-			spin_unlock_irqrestore(&pm8001_ha->lock, flags);
+			pm8001_unlock_all(pm8001_ha, flags);
 			ret = pm8001_abort_task(t);
 			ccb->open_retry = 0;
 			switch (ret) {
@@ -3478,12 +4174,12 @@ static void pm8001_work_fn(PMCS_WORK_ARG work)
 			break;
 
 		case TMF_RESP_FUNC_COMPLETE: /* task not on lu */
-			spin_unlock_irqrestore(&pm8001_ha->lock, flags);
+			pm8001_unlock_all(pm8001_ha, flags);
 			/* Do we need to abort the task locally? */
 			break;
 
 		default: /* device misbehavior */
-			spin_unlock_irqrestore(&pm8001_ha->lock, flags);
+			pm8001_unlock_all(pm8001_ha, flags);
 			ret = TMF_RESP_FUNC_FAILED;
 			PM8001_IO_DBG(pm8001_ha,
 				pm8001_printk("...Reset phy\n"));
@@ -3492,9 +4188,19 @@ static void pm8001_work_fn(PMCS_WORK_ARG work)
 
 		if (ret == TMF_RESP_FUNC_FAILED)
 			t = NULL;
+		if (pm8001_orej_defer(pm8001_ha, pw, t, tag, pm8001_dev)) {
+			PM8001_IO_DBG(pm8001_ha, pm8001_printk("...Held\n"));
+			return; /* the wheel requeues pw */
+		}
 		pm8001_open_reject_retry(pm8001_ha, t, pm8001_dev);
 		PM8001_IO_DBG(pm8001_ha, pm8001_printk("...Complete\n"));
 	}	break;
+	case PM8001_WORK_OREJ_RETRY:
+		pm8001_orej_retry(pw->pm8001_ha, pw, pm8001_dev);
+		break;
+	case PM8001_WORK_STALL:
+		pm8001_stall_recover(pw->pm8001_ha, pw, pm8001_dev);
+		break;
 	case IO_OPEN_CNX_ERROR_IT_NEXUS_LOSS:
 		dev = pm8001_dev->sas_device;
 		pm8001_I_T_nexus_reset(dev);
@@ -3512,7 +4218,7 @@ static void pm8001_work_fn(PMCS_WORK_ARG work)
 		pm8001_I_T_nexus_reset(dev);
 		break;
 	}
-	PMFREE(pw, sizeof(*pw));
+	pm8001_work_put(pw->pm8001_ha, pw);
 }
 
 static int pm8001_handle_event(struct pm8001_hba_info *pm8001_ha, void *data,
@@ -3521,15 +4227,19 @@ static int pm8001_handle_event(struct pm8001_hba_info *pm8001_ha, void *data,
 	struct pm8001_work *pw;
 	int ret = 0;
 
-	pw = PMALLOC(sizeof(struct pm8001_work), GFP_ATOMIC);
+	pw = pm8001_work_get(pm8001_ha);
 	if (pw) {
 		pw->pm8001_ha = pm8001_ha;
 		pw->data = data;
 		pw->handler = handler;
 		INIT_WORK(&pw->work, pm8001_work_fn);
 		queue_work(pm8001_wq, &pw->work);
-	} else
+	} else {
+		PM8001_FAIL_DBG(pm8001_ha,
+			pm8001_printk("event 0x%x dropped, no work item\n",
+				handler));
 		ret = -ENOMEM;
+	}
 
 	return ret;
 }
@@ -3670,18 +4380,172 @@ mpi_status_string(u32 status)
 }
 
 /**
- * mpi_ssp_completion- process the event that FW response to the SSP request.
+ * pm8001_task_done - hand a finished task back once the drain is over
+ * @pm8001_ha: our hba card information
+ * @t: the task, already released from its ccb
+ * @ccb: the ccb it ran on, for the submitting cpu
+ *
+ * Outbound handlers run with their queue's oq_lock held and interrupts
+ * off, so the task is queued on this cpu's batch and its task_done runs
+ * from pm8001_task_done_flush once the lock is dropped.  If the batch is
+ * full it is called straight away.
+ */
+static void pm8001_task_done(struct pm8001_hba_info *pm8001_ha,
+	struct sas_task *t, struct pm8001_ccb_info *ccb)
+{
+	struct pm8001_done_batch *batch =
+		per_cpu_ptr(pm8001_ha->done_batch, smp_processor_id());
+
+	if (unlikely(batch->count == PM8001_DONE_BATCH)) {
+		batch->overflow++;
+		t->task_done(t);
+		return;
+	}
+	batch->cpu[batch->count] = ccb->cpu;
+	batch->task[batch->count++] = t;
+}
+
+/**
+ * pm8001_task_done_remote - complete the tasks other cpus steered here
+ * @info: this cpu's done batch
+ *
+ * Runs from the IPI sent by pm8001_task_done_kick, or in place if the
+ * cpu went offline before it could be interrupted.
+ */
+static void pm8001_task_done_remote(void *info)
+{
+	struct pm8001_done_batch *batch = info;
+	struct sas_task *t;
+	unsigned long flags;
+
+	for (;;) {
+		spin_lock_irqsave(&batch->remote_lock, flags);
+		if (!batch->remote_count) {
+			spin_unlock_irqrestore(&batch->remote_lock, flags);
+			break;
+		}
+		t = batch->remote[--batch->remote_count];
+		spin_unlock_irqrestore(&batch->remote_lock, flags);
+		t->task_done(t);
+	}
+}
+
+/**
+ * pm8001_task_done_steer - queue a task for completion on its submitter
+ * @pm8001_ha: our hba card information
+ * @batch: this cpu's done batch
+ * @kick: the caller's list of cpus to interrupt
+ * @t: the finished task
+ * @cpu: the cpu that submitted it
+ *
+ * The first task on an empty list earns that cpu an IPI, sent by
+ * pm8001_task_done_kick once interrupts are back on.  Returns 0 if the
+ * list is full and the task should be completed here.
+ */
+static int pm8001_task_done_steer(struct pm8001_hba_info *pm8001_ha,
+	struct pm8001_done_batch *batch, struct pm8001_done_kick *kick,
+	struct sas_task *t, int cpu)
+{
+	struct pm8001_done_batch *remote = per_cpu_ptr(pm8001_ha->done_batch,
+		cpu);
+	int first;
+
+	spin_lock(&remote->remote_lock);
+	if (remote->remote_count == PM8001_DONE_BATCH) {
+		spin_unlock(&remote->remote_lock);
+		return 0;
+	}
+	first = !remote->remote_count;
+	remote->remote[remote->remote_count++] = t;
+	spin_unlock(&remote->remote_lock);
+	if (first)
+		kick->cpu[kick->n++] = cpu;
+	batch->steered++;
+	return 1;
+}
+
+/**
+ * pm8001_task_done_flush - complete the tasks batched during a drain
+ * @pm8001_ha: our hba card information
+ * @kick: where to list the cpus to interrupt, or NULL not to steer
+ *
+ * Called with interrupts still off but no driver lock held, once per
+ * drain pass.  A callback that completes more tasks on this cpu appends
+ * to the batch being walked.  Steering is left to callers that can send
+ * the IPIs afterwards with pm8001_task_done_kick; @kick lives on their
+ * stack, so it stays theirs even if they migrate once interrupts are on.
+ */
+static void pm8001_task_done_flush(struct pm8001_hba_info *pm8001_ha,
+	struct pm8001_done_kick *kick)
+{
+	int this_cpu = smp_processor_id();
+	struct pm8001_done_batch *batch =
+		per_cpu_ptr(pm8001_ha->done_batch, this_cpu);
+	struct sas_task *t;
+	int cpu, steer;
+	u32 i;
+
+	if (!batch->count)
+		return;
+	steer = kick && pm8001_ha->steer_completions;
+	for (i = 0; i < batch->count; i++) {
+		t = batch->task[i];
+		cpu = batch->cpu[i];
+		if (cpu == this_cpu)
+			batch->same_cpu++;
+		else {
+			batch->cross_cpu++;
+			if (steer && cpu_online(cpu) &&
+				pm8001_task_done_steer(pm8001_ha, batch, kick,
+					t, cpu))
+				continue;
+		}
+		t->task_done(t);
+	}
+	batch->tasks += batch->count;
+	batch->flushes++;
+	batch->count = 0;
+}
+
+/**
+ * pm8001_task_done_kick - interrupt the cpus tasks were steered to
+ * @pm8001_ha: our hba card information
+ * @kick: the list pm8001_task_done_flush filled in
+ *
+ * Called with interrupts on, after pm8001_task_done_flush.
+ */
+static void pm8001_task_done_kick(struct pm8001_hba_info *pm8001_ha,
+	struct pm8001_done_kick *kick)
+{
+	struct pm8001_done_batch *batch;
+	struct pm8001_done_batch *remote;
+	int cpu;
+
+	if (!kick->n)
+		return;
+	batch = per_cpu_ptr(pm8001_ha->done_batch, get_cpu());
+	while (kick->n) {
+		cpu = kick->cpu[--kick->n];
+		remote = per_cpu_ptr(pm8001_ha->done_batch, cpu);
+		if (smp_call_function_single(cpu, pm8001_task_done_remote,
+			remote, 0))
+			pm8001_task_done_remote(remote);
+		else
+			batch->ipis++;
+	}
+	put_cpu();
+}
+
+/**
+ * mpi_ssp_completion_slow - decode an SSP completion that is not plain GOOD
  * @pm8001_ha: our hba card information
  * @piomb: the message contents of this outbound message.
  *
- * When FW has completed a ssp request for example a IO request, after it has
- * filled the SG data with the data, it will trigger this event represent
- * that he has finished the job,please check the coresponding buffer.
- * So we will tell the caller who maybe waiting the result to tell upper layer
- * that the task has been finished.
+ * Errors, underruns, response frames and stale tags.  Kept out of line so
+ * the common case in mpi_ssp_completion stays small.
  */
-static void
-mpi_ssp_completion(struct pm8001_hba_info *pm8001_ha , void *piomb)
+static noinline void
+mpi_ssp_completion_slow(struct pm8001_hba_info *pm8001_ha, void *piomb)
 {
 	struct sas_task *t;
 	struct pm8001_ccb_info *ccb;
@@ -3745,8 +4609,8 @@ mpi_ssp_completion(struct pm8001_hba_info *pm8001_ha , void *piomb)
 		PM8001_FAIL_DBG(pm8001_ha,
 			pm8001_printk("no task or dev! tag: %u alloc:%u req: %u)\n",
 				tag,
-				pm8001_ha->tags_alloc,
-				pm8001_dev->running_req));
+				atomic_read(&pm8001_ha->tags_alloc),
+				atomic_read(&pm8001_dev->running_req)));
 		pm8001_ccb_task_free(pm8001_ha, NULL, ccb, tag);
 		return;
 	}
@@ -3968,8 +4832,60 @@ mpi_ssp_completion(struct pm8001_hba_info *pm8001_ha , void *piomb)
 		spin_unlock_irqrestore(&t->task_state_lock, flags);
 		pm8001_ccb_task_free(pm8001_ha, t, ccb, tag);
 		mb();/* in order to force CPU ordering */
-		t->task_done(t);
+		pm8001_task_done(pm8001_ha, t, ccb);
+	}
+}
+
+/**
+ * mpi_ssp_completion- process the event that FW response to the SSP request.
+ * @pm8001_ha: our hba card information
+ * @piomb: the message contents of this outbound message.
+ *
+ * When FW has completed a ssp request for example a IO request, after it has
+ * filled the SG data with the data, it will trigger this event represent
+ * that he has finished the job,please check the coresponding buffer.
+ * So we will tell the caller who maybe waiting the result to tell upper layer
+ * that the task has been finished.
+ *
+ * GOOD status without a response frame is finished here; everything else
+ * goes to mpi_ssp_completion_slow.
+ */
+static void
+mpi_ssp_completion(struct pm8001_hba_info *pm8001_ha, void *piomb)
+{
+	struct ssp_completion_resp *psspPayload =
+		(struct ssp_completion_resp *)(piomb + 4);
+	u32 tag = le32_to_cpu(psspPayload->tag);
+	struct pm8001_ccb_info *ccb = get_ccb_array(pm8001_ha, tag);
+	struct sas_task *t = ccb->task;
+	struct pm8001_device *pm8001_dev;
+	unsigned long flags;
+
+	if (unlikely((psspPayload->status != cpu_to_le32(IO_SUCCESS)) ||
+		psspPayload->param || (ccb->ccb_tag != tag) ||
+		!t || !t->lldd_task || !t->dev)) {
+		mpi_ssp_completion_slow(pm8001_ha, piomb);
+		return;
 	}
+	pm8001_dev = ccb->device;
+	DEC_REQ(pm8001_dev, pm8001_ha);
+	pm8001_dev->orej = 0;
+	t->task_status.resp = SAS_TASK_COMPLETE;
+	t->task_status.stat = SAM_STAT_GOOD;
+	spin_lock_irqsave(&t->task_state_lock, flags);
+	t->task_state_flags &= ~(SAS_TASK_STATE_PENDING | SAS_TASK_AT_INITIATOR);
+	t->task_state_flags |= SAS_TASK_STATE_DONE;
+	if (unlikely(t->task_state_flags & SAS_TASK_STATE_ABORTED)) {
+		spin_unlock_irqrestore(&t->task_state_lock, flags);
+		PM8001_FAIL_DBG(pm8001_ha, pm8001_printk("task 0x%p done with"
+			" status IO_SUCCESS but aborted by upper layer!\n", t));
+		pm8001_ccb_task_free(pm8001_ha, t, ccb, tag);
+		return;
+	}
+	spin_unlock_irqrestore(&t->task_state_lock, flags);
+	pm8001_ccb_task_free(pm8001_ha, t, ccb, tag);
+	mb();/* in order to force CPU ordering */
+	pm8001_task_done(pm8001_ha, t, ccb);
 }
 
 /*See the comments for mpi_ssp_completion */
@@ -4023,10 +4939,10 @@ static void mpi_ssp_event(struct pm8001_hba_info *pm8001_ha , void *piomb)
 	if (unlikely(!t || !t->lldd_task || !t->dev)) {
 		PM8001_FAIL_DBG(pm8001_ha,
 			pm8001_printk("no task or dev! (%u)\n",
-				pm8001_ha->tags_alloc));
+				atomic_read(&pm8001_ha->tags_alloc)));
 		return;
 	}
-	BUG_ON(pm8001_dev->running_req == 0); /* DEC_REQ happens later */
+	BUG_ON(atomic_read(&pm8001_dev->running_req) == 0); /* DEC_REQ happens later */
 	ts = &t->task_status;
 	PM8001_IO_DBG(pm8001_ha,
 		pm8001_printk("port_id = %x,device_id = %x\n",
@@ -4184,7 +5100,7 @@ static void mpi_ssp_event(struct pm8001_hba_info *pm8001_ha , void *piomb)
 		spin_unlock_irqrestore(&t->task_state_lock, flags);
 		pm8001_ccb_task_free(pm8001_ha, t, ccb, tag);
 		mb();/* in order to force CPU ordering */
-		t->task_done(t);
+		pm8001_task_done(pm8001_ha, t, ccb);
 	}
 }
 
@@ -4230,7 +5146,7 @@ mpi_sata_completion(struct pm8001_hba_info *pm8001_ha, void *piomb)
 	if (unlikely(!t || !t->lldd_task || !t->dev)) {
 		PM8001_FAIL_DBG(pm8001_ha,
 			pm8001_printk("no task or dev! (%u)\n",
-				pm8001_ha->tags_alloc));
+				atomic_read(&pm8001_ha->tags_alloc)));
 		return;
 	}
 	DEC_REQ(pm8001_dev, pm8001_ha);
@@ -4348,9 +5264,7 @@ mpi_sata_completion(struct pm8001_hba_info *pm8001_ha, void *piomb)
 			ts->stat = SAS_QUEUE_FULL;
 			pm8001_ccb_task_free(pm8001_ha, t, ccb, tag);
 			mb();/*in order to force CPU ordering*/
-			spin_unlock_irq(&pm8001_ha->lock);
-			t->task_done(t);
-			spin_lock_irq(&pm8001_ha->lock);
+			pm8001_task_done(pm8001_ha, t, ccb);
 			return;
 		}
 		break;
@@ -4368,9 +5282,7 @@ mpi_sata_completion(struct pm8001_hba_info *pm8001_ha, void *piomb)
 			ts->stat = SAS_QUEUE_FULL;
 			pm8001_ccb_task_free(pm8001_ha, t, ccb, tag);
 			mb();/*ditto*/
-			spin_unlock_irq(&pm8001_ha->lock);
-			t->task_done(t);
-			spin_lock_irq(&pm8001_ha->lock);
+			pm8001_task_done(pm8001_ha, t, ccb);
 			return;
 		}
 		break;
@@ -4396,9 +5308,7 @@ mpi_sata_completion(struct pm8001_hba_info *pm8001_ha, void *piomb)
 			ts->stat = SAS_QUEUE_FULL;
 			pm8001_ccb_task_free(pm8001_ha, t, ccb, tag);
 			mb();/* ditto*/
-			spin_unlock_irq(&pm8001_ha->lock);
-			t->task_done(t);
-			spin_lock_irq(&pm8001_ha->lock);
+			pm8001_task_done(pm8001_ha, t, ccb);
 			return;
 		}
 		break;
@@ -4463,9 +5373,7 @@ mpi_sata_completion(struct pm8001_hba_info *pm8001_ha, void *piomb)
 			ts->stat = SAS_QUEUE_FULL;
 			pm8001_ccb_task_free(pm8001_ha, t, ccb, tag);
 			mb();/*ditto*/
-			spin_unlock_irq(&pm8001_ha->lock);
-			t->task_done(t);
-			spin_lock_irq(&pm8001_ha->lock);
+			pm8001_task_done(pm8001_ha, t, ccb);
 			return;
 		}
 		break;
@@ -4487,9 +5395,7 @@ mpi_sata_completion(struct pm8001_hba_info *pm8001_ha, void *piomb)
 			ts->stat = SAS_QUEUE_FULL;
 			pm8001_ccb_task_free(pm8001_ha, t, ccb, tag);
 			mb();/*ditto*/
-			spin_unlock_irq(&pm8001_ha->lock);
-			t->task_done(t);
-			spin_lock_irq(&pm8001_ha->lock);
+			pm8001_task_done(pm8001_ha, t, ccb);
 			return;
 		}
 		break;
@@ -4523,16 +5429,12 @@ mpi_sata_completion(struct pm8001_hba_info *pm8001_ha, void *piomb)
 		spin_unlock_irqrestore(&t->task_state_lock, flags);
 		pm8001_ccb_task_free(pm8001_ha, t, ccb, tag);
 		mb();/* ditto */
-		spin_unlock_irq(&pm8001_ha->lock);
-		t->task_done(t);
-		spin_lock_irq(&pm8001_ha->lock);
+		pm8001_task_done(pm8001_ha, t, ccb);
 	} else if (!t->uldd_task) {
 		spin_unlock_irqrestore(&t->task_state_lock, flags);
 		pm8001_ccb_task_free(pm8001_ha, t, ccb, tag);
 		mb();/*ditto*/
-		spin_unlock_irq(&pm8001_ha->lock);
-		t->task_done(t);
-		spin_lock_irq(&pm8001_ha->lock);
+		pm8001_task_done(pm8001_ha, t, ccb);
 	}
 }
 
@@ -4571,7 +5473,7 @@ static void mpi_sata_event(struct pm8001_hba_info *pm8001_ha , void *piomb)
 	if (unlikely(!t || !t->lldd_task || !t->dev)) {
 		PM8001_FAIL_DBG(pm8001_ha,
 			pm8001_printk("no task or dev! (%u)\n",
-				pm8001_ha->tags_alloc));
+				atomic_read(&pm8001_ha->tags_alloc)));
 		return;
 	}
 	DEC_REQ(pm8001_dev, pm8001_ha);
@@ -4634,9 +5536,7 @@ static void mpi_sata_event(struct pm8001_hba_info *pm8001_ha , void *piomb)
 			ts->stat = SAS_QUEUE_FULL;
 			pm8001_ccb_task_free(pm8001_ha, t, ccb, tag);
 			mb();/*ditto*/
-			spin_unlock_irq(&pm8001_ha->lock);
-			t->task_done(t);
-			spin_lock_irq(&pm8001_ha->lock);
+			pm8001_task_done(pm8001_ha, t, ccb);
 			return;
 		}
 		break;
@@ -4750,16 +5650,12 @@ static void mpi_sata_event(struct pm8001_hba_info *pm8001_ha , void *piomb)
 		spin_unlock_irqrestore(&t->task_state_lock, flags);
 		pm8001_ccb_task_free(pm8001_ha, t, ccb, tag);
 		mb();/* ditto */
-		spin_unlock_irq(&pm8001_ha->lock);
-		t->task_done(t);
-		spin_lock_irq(&pm8001_ha->lock);
+		pm8001_task_done(pm8001_ha, t, ccb);
 	} else if (!t->uldd_task) {
 		spin_unlock_irqrestore(&t->task_state_lock, flags);
 		pm8001_ccb_task_free(pm8001_ha, t, ccb, tag);
 		mb();/*ditto*/
-		spin_unlock_irq(&pm8001_ha->lock);
-		t->task_done(t);
-		spin_lock_irq(&pm8001_ha->lock);
+		pm8001_task_done(pm8001_ha, t, ccb);
 	}
 }
 
@@ -4803,7 +5699,7 @@ mpi_smp_completion(struct pm8001_hba_info *pm8001_ha, void *piomb)
 	if (unlikely(!t || !t->lldd_task || !t->dev)) {
 		PM8001_FAIL_DBG(pm8001_ha,
 			pm8001_printk("no task or dev! (%u)\n",
-				pm8001_ha->tags_alloc));
+				atomic_read(&pm8001_ha->tags_alloc)));
 		return;
 	}
 	DEC_REQ(pm8001_dev, pm8001_ha);
@@ -4986,7 +5882,7 @@ mpi_smp_completion(struct pm8001_hba_info *pm8001_ha, void *piomb)
 		spin_unlock_irqrestore(&t->task_state_lock, flags);
 		pm8001_ccb_task_free(pm8001_ha, t, ccb, tag);
 		mb();/* in order to force CPU ordering */
-		t->task_done(t);
+		pm8001_task_done(pm8001_ha, t, ccb);
 	}
 }
 
@@ -5123,7 +6019,7 @@ mpi_get_nvmd_resp(struct pm8001_hba_info *pm8001_ha, void *piomb)
 	pm8001_ccb_free(pm8001_ha, tag);
 }
 
-static int mpi_local_phy_ctl(struct pm8001_hba_info *pm8001_ha, void *piomb)
+static void mpi_local_phy_ctl(struct pm8001_hba_info *pm8001_ha, void *piomb)
 {
 	struct local_phy_ctl_resp *pPayload =
 		(struct local_phy_ctl_resp *)(piomb + 4);
@@ -5144,7 +6040,6 @@ static int mpi_local_phy_ctl(struct pm8001_hba_info *pm8001_ha, void *piomb)
 	ccb->task = NULL;
 	ccb->ccb_tag = 0xFFFFFFFF;
 	pm8001_ccb_free(pm8001_ha, tag);
-	return 0;
 }
 
 /**
@@ -5540,7 +6435,7 @@ hw_event_phy_down(struct pm8001_hba_info *pm8001_ha, void *piomb)
  * has assigned, from now,inter-communication with FW is no longer using the
  * SAS address, use device ID which FW assigned.
  */
-static int mpi_reg_resp(struct pm8001_hba_info *pm8001_ha, void *piomb)
+static void mpi_reg_resp(struct pm8001_hba_info *pm8001_ha, void *piomb)
 {
 	u32 status;
 	u32 device_id;
@@ -5597,14 +6492,15 @@ static int mpi_reg_resp(struct pm8001_hba_info *pm8001_ha, void *piomb)
 		 pm8001_printk("DEVREG_FAILURE_DEVICE_TYPE_NOT_UNSORPORTED\n"));
 		break;
 	}
-	complete(pm8001_dev->dcompletion);
+	/* nobody waits on a response that arrives after the waiter gave up */
+	if (pm8001_dev->dcompletion)
+		complete(pm8001_dev->dcompletion);
 	ccb->task = NULL;
 	ccb->ccb_tag = 0xFFFFFFFF;
 	pm8001_ccb_free(pm8001_ha, htag);
-	return 0;
 }
 
-static int mpi_dereg_resp(struct pm8001_hba_info *pm8001_ha, void *piomb)
+static void mpi_dereg_resp(struct pm8001_hba_info *pm8001_ha, void *piomb)
 {
 	u32 status;
 	u32 device_id;
@@ -5623,10 +6519,9 @@ static int mpi_dereg_resp(struct pm8001_hba_info *pm8001_ha, void *piomb)
 	ccb->task = NULL;
 	ccb->ccb_tag = 0xFFFFFFFF;
 	pm8001_ccb_free(pm8001_ha, tag);
-	return 0;
 }
 
-static int
+static void
 mpi_fw_flash_update_resp(struct pm8001_hba_info *pm8001_ha, void *piomb)
 {
 	u32 status;
@@ -5690,10 +6585,9 @@ mpi_fw_flash_update_resp(struct pm8001_hba_info *pm8001_ha, void *piomb)
 	ccb->task = NULL;
 	ccb->ccb_tag = 0xFFFFFFFF;
 	pm8001_ccb_free(pm8001_ha, tag);
-	return 0;
 }
 
-static int
+static void
 mpi_general_event(struct pm8001_hba_info *pm8001_ha , void *piomb)
 {
 	u32 status;
@@ -5708,7 +6602,6 @@ mpi_general_event(struct pm8001_hba_info *pm8001_ha , void *piomb)
 		PM8001_MSG_DBG(pm8001_ha,
 			pm8001_printk("inb_IOMB_payload[0x%x] 0x%x,\n", i,
 			pPayload->inb_IOMB_payload[i]));
-	return 0;
 }
 
 static void
@@ -5724,7 +6617,7 @@ mpi_hw_event_ack_resp(struct pm8001_hba_info *pm8001_ha , void *piomb)
 	pm8001_ccb_free(pm8001_ha, tag);
 }
 
-static int
+static void
 mpi_task_abort_resp(struct pm8001_hba_info *pm8001_ha, void *piomb)
 {
 	struct sas_task *t;
@@ -5742,11 +6635,11 @@ mpi_task_abort_resp(struct pm8001_hba_info *pm8001_ha, void *piomb)
 	if (ccb->ccb_tag != tag) {
 		if ((ccb->ccb_tag == 0xffffffff)
 		 || (TAG_IDX_MASK(ccb->ccb_tag) == TAG_IDX_MASK(tag)))
-			return -1;
+			return;
 		PM8001_FAIL_DBG(pm8001_ha,
 			pm8001_printk("incoming tag 0x%x does not match "
 			"ccb tag 0x%x\n", tag, ccb->ccb_tag));
-		return -1;
+		return;
 	}
 	pm8001_dev = ccb->device;
 	DEC_REQ(pm8001_dev, pm8001_ha);
@@ -5759,7 +6652,7 @@ mpi_task_abort_resp(struct pm8001_hba_info *pm8001_ha, void *piomb)
 	if (t == NULL) {
 		pm8001_printk("status = %s\n", mpi_status_string(status));
 		pm8001_ccb_task_free(pm8001_ha, t, ccb, tag);
-		return -1;
+		return;
 	}
 	ts = &t->task_status;
 	if (status != 0)
@@ -5785,8 +6678,20 @@ mpi_task_abort_resp(struct pm8001_hba_info *pm8001_ha, void *piomb)
 	spin_unlock_irqrestore(&t->task_state_lock, flags);
 	pm8001_ccb_task_free(pm8001_ha, t, ccb, tag);
 	mb();
-	t->task_done(t);
-	return 0;
+	pm8001_task_done(pm8001_ha, t, ccb);
+}
+
+/**
+ * pm8001_reset_phy_up - a phy the host reset is waiting on came up
+ * @pm8001_ha: our hba card information
+ * @phy_id: the phy
+ */
+static void pm8001_reset_phy_up(struct pm8001_hba_info *pm8001_ha, u8 phy_id)
+{
+	if (!test_and_clear_bit(phy_id, &pm8001_ha->phy_up_wait))
+		return;
+	pm8001_reset_mark(pm8001_ha, PM8001_RESET_PHY_UP, phy_id);
+	complete(&pm8001_ha->phy_up_done);
 }
 
 /**
@@ -5794,7 +6699,7 @@ mpi_task_abort_resp(struct pm8001_hba_info *pm8001_ha, void *piomb)
  * @pm8001_ha: our hba card information
  * @piomb: IO message buffer
  */
-static int mpi_hw_event(struct pm8001_hba_info *pm8001_ha, void* piomb)
+static void mpi_hw_event(struct pm8001_hba_info *pm8001_ha, void* piomb)
 {
 	unsigned long flags;
 	struct hw_event_resp *pPayload =
@@ -5824,6 +6729,8 @@ static int mpi_hw_event(struct pm8001_hba_info *pm8001_ha, void* piomb)
 			" status = %x\n", status));
 		if (status == 0) {
 			phy->phy_state = 1;
+			pm8001_reset_mark(pm8001_ha, PM8001_RESET_PHY_STARTED,
+				phy_id);
 			if (pm8001_ha->flags == PM8001F_RUN_TIME)
 				complete(phy->enable_completion);
 		}
@@ -5835,11 +6742,13 @@ static int mpi_hw_event(struct pm8001_hba_info *pm8001_ha, void* piomb)
 		PM8001_EVT_DBG(pm8001_ha,
 			pm8001_printk("HW_EVENT_PHY_START_STATUS\n"));
 		hw_event_sas_phy_up(pm8001_ha, piomb);
+		pm8001_reset_phy_up(pm8001_ha, phy_id);
 		break;
 	case HW_EVENT_SATA_PHY_UP:
 		PM8001_EVT_DBG(pm8001_ha,
 			pm8001_printk("HW_EVENT_SATA_PHY_UP\n"));
 		hw_event_sata_phy_up(pm8001_ha, piomb);
+		pm8001_reset_phy_up(pm8001_ha, phy_id);
 		break;
 	case HW_EVENT_PHY_STOP_STATUS:
 		tag = le32_to_cpu(pPayload->evt_param);
@@ -6012,197 +6921,214 @@ static int mpi_hw_event(struct pm8001_hba_info *pm8001_ha, void* piomb)
 			pm8001_printk("Unknown event type = %x\n", eventType));
 		break;
 	}
-	return 0;
 }
 
+/*
+ * Outbound opcodes.  Unlocked handlers are the I/O completions, which only
+ * touch their own ccb, task and the atomic per-device count; the rest may
+ * change topology or shared hba state and also take pm8001_ha->lock.
+ * Opcodes without a handler are only logged.
+ */
+struct pm8001_oub_op {
+	void		(*handler)(struct pm8001_hba_info *pm8001_ha,
+				void *piomb);
+	u8		unlocked;
+	const char	*name;
+};
+#define	PM8001_OUB_OP(opc, fn, unlocked)	[opc] = { fn, unlocked, #opc }
+
+static const struct pm8001_oub_op pm8001_oub_ops[] = {
+	PM8001_OUB_OP(OPC_OUB_ECHO, NULL, 0),
+	PM8001_OUB_OP(OPC_OUB_HW_EVENT, mpi_hw_event, 0),
+	PM8001_OUB_OP(OPC_OUB_SSP_COMP, mpi_ssp_completion, 1),
+	PM8001_OUB_OP(OPC_OUB_SMP_COMP, mpi_smp_completion, 1),
+	PM8001_OUB_OP(OPC_OUB_LOCAL_PHY_CNTRL, mpi_local_phy_ctl, 0),
+	PM8001_OUB_OP(OPC_OUB_DEV_REGIST, mpi_reg_resp, 0),
+	PM8001_OUB_OP(OPC_OUB_DEREG_DEV, mpi_dereg_resp, 0),
+	PM8001_OUB_OP(OPC_OUB_GET_DEV_HANDLE, NULL, 0),
+	PM8001_OUB_OP(OPC_OUB_SATA_COMP, mpi_sata_completion, 1),
+	PM8001_OUB_OP(OPC_OUB_SATA_EVENT, mpi_sata_event, 1),
+	PM8001_OUB_OP(OPC_OUB_SSP_EVENT, mpi_ssp_event, 1),
+	/* target mode only */
+	PM8001_OUB_OP(OPC_OUB_DEV_HANDLE_ARRIV, NULL, 0),
+	PM8001_OUB_OP(OPC_OUB_SSP_RECV_EVENT, NULL, 0),
+	PM8001_OUB_OP(OPC_OUB_DEV_INFO, NULL, 0),
+	PM8001_OUB_OP(OPC_OUB_FW_FLASH_UPDATE, mpi_fw_flash_update_resp, 0),
+	PM8001_OUB_OP(OPC_OUB_GPIO_RESPONSE, NULL, 0),
+	PM8001_OUB_OP(OPC_OUB_GPIO_EVENT, NULL, 0),
+	PM8001_OUB_OP(OPC_OUB_GENERAL_EVENT, mpi_general_event, 0),
+	PM8001_OUB_OP(OPC_OUB_SSP_ABORT_RSP, mpi_task_abort_resp, 0),
+	PM8001_OUB_OP(OPC_OUB_SATA_ABORT_RSP, mpi_task_abort_resp, 0),
+	PM8001_OUB_OP(OPC_OUB_SAS_DIAG_MODE_START_END, NULL, 0),
+	PM8001_OUB_OP(OPC_OUB_SAS_DIAG_EXECUTE, NULL, 0),
+	PM8001_OUB_OP(OPC_OUB_GET_TIME_STAMP, NULL, 0),
+	PM8001_OUB_OP(OPC_OUB_SAS_HW_EVENT_ACK, mpi_hw_event_ack_resp, 0),
+	PM8001_OUB_OP(OPC_OUB_PORT_CONTROL, NULL, 0),
+	PM8001_OUB_OP(OPC_OUB_SMP_ABORT_RSP, mpi_task_abort_resp, 0),
+	PM8001_OUB_OP(OPC_OUB_GET_NVMD_DATA, mpi_get_nvmd_resp, 0),
+	PM8001_OUB_OP(OPC_OUB_SET_NVMD_DATA, mpi_set_nvmd_resp, 0),
+	PM8001_OUB_OP(OPC_OUB_DEVICE_HANDLE_REMOVAL, NULL, 0),
+	PM8001_OUB_OP(OPC_OUB_SET_DEVICE_STATE, mpi_set_dev_state_resp, 0),
+	PM8001_OUB_OP(OPC_OUB_GET_DEVICE_STATE, NULL, 0),
+	PM8001_OUB_OP(OPC_OUB_SET_DEV_INFO, NULL, 0),
+	PM8001_OUB_OP(OPC_OUB_SAS_RE_INITIALIZE, mpi_sas_re_initialize_resp, 0),
+};
+
 /**
  * process_one_iomb - process one outbound Queue memory block
  * @pm8001_ha: our hba card information
  * @piomb: IO message buffer
+ *
+ * Called with the owning outbound queue's oq_lock held.
  */
 static void process_one_iomb(struct pm8001_hba_info *pm8001_ha, void *piomb)
 {
-	__le32 pHeader = (__le32)*(__le32 *)piomb;
-	u8 opc = (u8)((le32_to_cpu(pHeader)) & 0xFFF);
+	u32 opc = le32_to_cpu(*(__le32 *)piomb) & 0xFFF;
+	const struct pm8001_oub_op *op;
 
-	PM8001_MSG_DBG2(pm8001_ha, pm8001_printk("process_one_iomb\n"));
-
-	switch (opc) {
-	case OPC_OUB_ECHO:
-		PM8001_MSG_DBG(pm8001_ha, pm8001_printk("OPC_OUB_ECHO\n"));
-		break;
-	case OPC_OUB_HW_EVENT:
-		PM8001_MSG_DBG(pm8001_ha,
-			pm8001_printk("OPC_OUB_HW_EVENT\n"));
-		mpi_hw_event(pm8001_ha, piomb);
-		break;
-	case OPC_OUB_SSP_COMP:
-		PM8001_MSG_DBG(pm8001_ha,
-			pm8001_printk("OPC_OUB_SSP_COMP\n"));
-		mpi_ssp_completion(pm8001_ha, piomb);
-		break;
-	case OPC_OUB_SMP_COMP:
-		PM8001_MSG_DBG(pm8001_ha,
-			pm8001_printk("OPC_OUB_SMP_COMP\n"));
-		mpi_smp_completion(pm8001_ha, piomb);
-		break;
-	case OPC_OUB_LOCAL_PHY_CNTRL:
-		PM8001_MSG_DBG(pm8001_ha,
-			pm8001_printk("OPC_OUB_LOCAL_PHY_CNTRL\n"));
-		mpi_local_phy_ctl(pm8001_ha, piomb);
-		break;
-	case OPC_OUB_DEV_REGIST:
-		PM8001_MSG_DBG(pm8001_ha,
-			pm8001_printk("OPC_OUB_DEV_REGIST\n"));
-		mpi_reg_resp(pm8001_ha, piomb);
-		break;
-	case OPC_OUB_DEREG_DEV:
-		PM8001_MSG_DBG(pm8001_ha,
-			pm8001_printk("OPC_OUB_DEREG_DEV\n"));
-		mpi_dereg_resp(pm8001_ha, piomb);
-		break;
-	case OPC_OUB_GET_DEV_HANDLE:
-		PM8001_MSG_DBG(pm8001_ha,
-			pm8001_printk("OPC_OUB_GET_DEV_HANDLE\n"));
-		break;
-	case OPC_OUB_SATA_COMP:
-		PM8001_MSG_DBG(pm8001_ha,
-			pm8001_printk("OPC_OUB_SATA_COMP\n"));
-		mpi_sata_completion(pm8001_ha, piomb);
-		break;
-	case OPC_OUB_SATA_EVENT:
-		PM8001_MSG_DBG(pm8001_ha,
-			pm8001_printk("OPC_OUB_SATA_EVENT\n"));
-		mpi_sata_event(pm8001_ha, piomb);
-		break;
-	case OPC_OUB_SSP_EVENT:
-		PM8001_MSG_DBG(pm8001_ha,
-			pm8001_printk("OPC_OUB_SSP_EVENT\n"));
-		mpi_ssp_event(pm8001_ha, piomb);
-		break;
-	case OPC_OUB_DEV_HANDLE_ARRIV:
-		PM8001_MSG_DBG(pm8001_ha,
-			pm8001_printk("OPC_OUB_DEV_HANDLE_ARRIV\n"));
-		/*This is for target*/
-		break;
-	case OPC_OUB_SSP_RECV_EVENT:
-		PM8001_MSG_DBG(pm8001_ha,
-			pm8001_printk("OPC_OUB_SSP_RECV_EVENT\n"));
-		/*This is for target*/
-		break;
-	case OPC_OUB_DEV_INFO:
-		PM8001_MSG_DBG(pm8001_ha,
-			pm8001_printk("OPC_OUB_DEV_INFO\n"));
-		break;
-	case OPC_OUB_FW_FLASH_UPDATE:
-		PM8001_MSG_DBG(pm8001_ha,
-			pm8001_printk("OPC_OUB_FW_FLASH_UPDATE\n"));
-		mpi_fw_flash_update_resp(pm8001_ha, piomb);
-		break;
-	case OPC_OUB_GPIO_RESPONSE:
-		PM8001_MSG_DBG(pm8001_ha,
-			pm8001_printk("OPC_OUB_GPIO_RESPONSE\n"));
-		break;
-	case OPC_OUB_GPIO_EVENT:
-		PM8001_MSG_DBG(pm8001_ha,
-			pm8001_printk("OPC_OUB_GPIO_EVENT\n"));
-		break;
-	case OPC_OUB_GENERAL_EVENT:
-		PM8001_MSG_DBG(pm8001_ha,
-			pm8001_printk("OPC_OUB_GENERAL_EVENT\n"));
-		mpi_general_event(pm8001_ha, piomb);
-		break;
-	case OPC_OUB_SSP_ABORT_RSP:
-		PM8001_MSG_DBG(pm8001_ha,
-			pm8001_printk("OPC_OUB_SSP_ABORT_RSP\n"));
-		mpi_task_abort_resp(pm8001_ha, piomb);
-		break;
-	case OPC_OUB_SATA_ABORT_RSP:
-		PM8001_MSG_DBG(pm8001_ha,
-			pm8001_printk("OPC_OUB_SATA_ABORT_RSP\n"));
-		mpi_task_abort_resp(pm8001_ha, piomb);
-		break;
-	case OPC_OUB_SAS_DIAG_MODE_START_END:
-		PM8001_MSG_DBG(pm8001_ha,
-			pm8001_printk("OPC_OUB_SAS_DIAG_MODE_START_END\n"));
-		break;
-	case OPC_OUB_SAS_DIAG_EXECUTE:
-		PM8001_MSG_DBG(pm8001_ha,
-			pm8001_printk("OPC_OUB_SAS_DIAG_EXECUTE\n"));
-		break;
-	case OPC_OUB_GET_TIME_STAMP:
-		PM8001_MSG_DBG(pm8001_ha,
-			pm8001_printk("OPC_OUB_GET_TIME_STAMP\n"));
-		break;
-	case OPC_OUB_SAS_HW_EVENT_ACK:
-		PM8001_MSG_DBG(pm8001_ha,
-			pm8001_printk("OPC_OUB_SAS_HW_EVENT_ACK\n"));
-		mpi_hw_event_ack_resp(pm8001_ha, piomb);
-		break;
-	case OPC_OUB_PORT_CONTROL:
-		PM8001_MSG_DBG(pm8001_ha,
-			pm8001_printk("OPC_OUB_PORT_CONTROL\n"));
-		break;
-	case OPC_OUB_SMP_ABORT_RSP:
-		PM8001_MSG_DBG(pm8001_ha,
-			pm8001_printk("OPC_OUB_SMP_ABORT_RSP\n"));
-		mpi_task_abort_resp(pm8001_ha, piomb);
-		break;
-	case OPC_OUB_GET_NVMD_DATA:
-		PM8001_MSG_DBG(pm8001_ha,
-			pm8001_printk("OPC_OUB_GET_NVMD_DATA\n"));
-		mpi_get_nvmd_resp(pm8001_ha, piomb);
-		break;
-	case OPC_OUB_SET_NVMD_DATA:
-		PM8001_MSG_DBG(pm8001_ha,
-			pm8001_printk("OPC_OUB_SET_NVMD_DATA\n"));
-		mpi_set_nvmd_resp(pm8001_ha, piomb);
-		break;
-	case OPC_OUB_DEVICE_HANDLE_REMOVAL:
-		PM8001_MSG_DBG(pm8001_ha,
-			pm8001_printk("OPC_OUB_DEVICE_HANDLE_REMOVAL\n"));
-		break;
-	case OPC_OUB_SET_DEVICE_STATE:
-		PM8001_MSG_DBG(pm8001_ha,
-			pm8001_printk("OPC_OUB_SET_DEVICE_STATE\n"));
-		mpi_set_dev_state_resp(pm8001_ha, piomb);
-		break;
-	case OPC_OUB_GET_DEVICE_STATE:
-		PM8001_MSG_DBG(pm8001_ha,
-			pm8001_printk("OPC_OUB_GET_DEVICE_STATE\n"));
-		break;
-	case OPC_OUB_SET_DEV_INFO:
-		PM8001_MSG_DBG(pm8001_ha,
-			pm8001_printk("OPC_OUB_SET_DEV_INFO\n"));
-		break;
-	case OPC_OUB_SAS_RE_INITIALIZE:
-		PM8001_MSG_DBG(pm8001_ha,
-			pm8001_printk("OPC_OUB_SAS_RE_INITIALIZE\n"));
-		mpi_sas_re_initialize_resp(pm8001_ha, piomb);
-		break;
-	default:
+	if (unlikely((opc >= ARRAY_SIZE(pm8001_oub_ops)) ||
+		!pm8001_oub_ops[opc].name)) {
 		PM8001_MSG_DBG(pm8001_ha,
 			pm8001_printk("Unknown outbound Queue IOMB OPC = %x\n",
 			opc));
-		break;
+		return;
+	}
+	op = &pm8001_oub_ops[opc];
+	PM8001_MSG_DBG(pm8001_ha, pm8001_printk("%s\n", op->name));
+	if (!op->handler)
+		return;
+	if (likely(op->unlocked)) {
+		op->handler(pm8001_ha, piomb);
+		return;
+	}
+	pm8001_spin_lock_counted(&pm8001_ha->lock, &pm8001_ha->lock_contended);
+	op->handler(pm8001_ha, piomb);
+	spin_unlock(&pm8001_ha->lock);
+}
+
+#ifdef PM8001_COMPLETION_PROFILE
+/**
+ * pm8001_completion_profile - account the cost of one I/O completion
+ * @circularQ: the outbound queue it came in on, oq_lock held
+ * @piomb: the completion IOMB
+ * @cycles: time spent in process_one_iomb
+ *
+ * Most of that time goes on cache misses against the ccb, the sas_task
+ * and the IOMB itself, so this tracks how the ccb layout performs.
+ */
+static void pm8001_completion_profile(struct outbound_queue_table *circularQ,
+	void *piomb, cycles_t cycles)
+{
+	u32 opc = le32_to_cpu(*(__le32 *)piomb) & 0xFFF;
+
+	if (opc == OPC_OUB_SSP_COMP) {
+		circularQ->ssp_comp++;
+		circularQ->ssp_cycles += cycles;
+	} else if (opc == OPC_OUB_SATA_COMP) {
+		circularQ->sata_comp++;
+		circularQ->sata_cycles += cycles;
 	}
 }
+#endif
 
-static int process_oq(struct pm8001_hba_info *pm8001_ha)
+/**
+ * pm8001_latency_account - bucket an ssp completion by its latency
+ * @pm8001_ha: our hba card information
+ * @circularQ: the outbound queue it came in on, oq_lock held
+ * @piomb: the completion IOMB, before it is processed
+ */
+static void pm8001_latency_account(struct pm8001_hba_info *pm8001_ha,
+	struct outbound_queue_table *circularQ, void *piomb)
+{
+	struct pm8001_ccb_info *ccb;
+	u32 tag;
+	s64 us;
+
+	if (!pm8001_ha->spin_usecs ||
+	    ((le32_to_cpu(*(__le32 *)piomb) & 0xFFF) != OPC_OUB_SSP_COMP))
+		return;
+	tag = le32_to_cpu(*((__le32 *)piomb + 1));
+	if (TAG_IDX_MASK(tag) >= pm8001_ha->ccb_count)
+		return;
+	ccb = get_ccb_array(pm8001_ha, tag);
+	if ((ccb->ccb_tag != tag) || !ktime_to_ns(ccb->issued))
+		return;
+	us = ktime_to_us(ktime_sub(ktime_get(), ccb->issued));
+	circularQ->lat_hist[circularQ->spinning ? 1 : 0]
+		[min_t(int, (us > 0) ? fls64(us) : 0, PM8001_LAT_BUCKETS - 1)]++;
+}
+
+/**
+ * pm8001_oq_prefetch - warm the cache for the IOMBs behind the current one
+ * @pm8001_ha: our hba card information
+ * @circularQ: the outbound queue, oq_lock held
+ * @next: index of the IOMB after the one about to be processed
+ *
+ * The next IOMB was fetched while the previous one was handled, so its tag
+ * can be read to fetch its ccb; the one after that is fetched in turn.
+ * Nothing is read past the producer index last seen.
+ */
+static inline void pm8001_oq_prefetch(struct pm8001_hba_info *pm8001_ha,
+	struct outbound_queue_table *circularQ, u32 next)
+{
+	u32 pi = le32_to_cpu(circularQ->producer_index);
+	u32 after = (next + 1) & pm8001_ha->mpi_queue_mask;
+	u32 tag;
+
+	if (next == pi)
+		return;
+	if (after != pi)
+		prefetch(circularQ->base_virt + after * 64);
+	/* completions and events carry their tag first */
+	tag = le32_to_cpu(*((__le32 *)(circularQ->base_virt + next * 64) + 1));
+	if (TAG_IDX_MASK(tag) < pm8001_ha->ccb_count)
+		prefetch(get_ccb_array(pm8001_ha, tag));
+}
+
+/**
+ * process_oq - drain one outbound queue
+ * @pm8001_ha: our hba card information
+ * @vec: the msix vector, and so the outbound queue, that fired
+ * @budget: most IOMBs to handle before giving the cpu back
+ *
+ * The consumer index is written to the chip every PM8001_OQ_CI_BATCH
+ * IOMBs and once more on the way out.
+ *
+ * Returns the number of IOMBs handled; less than @budget means the queue
+ * was found empty.
+ */
+static int process_oq(struct pm8001_hba_info *pm8001_ha, u8 vec, int budget)
 {
 	struct outbound_queue_table *circularQ;
 	void *pMsg1 = NULL;
 	u8 uninitialized_var(bc);
 	u32 ret = MPI_IO_STATUS_FAIL;
+	int done = 0, unpublished = 0;
 
-	circularQ = &pm8001_ha->outbnd_q_tbl[0];
-	do {
+	circularQ = &pm8001_ha->outbnd_q_tbl[vec];
+	while (done < budget) {
 		ret = mpi_msg_consume(pm8001_ha, circularQ, &pMsg1, &bc);
 		if (MPI_IO_STATUS_SUCCESS == ret) {
+#ifdef PM8001_COMPLETION_PROFILE
+			cycles_t start = get_cycles();
+#endif
+			pm8001_oq_prefetch(pm8001_ha, circularQ,
+				(circularQ->consumer_idx + bc) &
+				pm8001_ha->mpi_queue_mask);
+			pm8001_latency_account(pm8001_ha, circularQ, pMsg1 - 4);
 			/* process the outbound message */
 			process_one_iomb(pm8001_ha, (void *)(pMsg1 - 4));
+#ifdef PM8001_COMPLETION_PROFILE
+			pm8001_completion_profile(circularQ, pMsg1 - 4,
+				get_cycles() - start);
+#endif
 			/* free the message from the outbound circular buffer */
 			mpi_msg_free_set(pm8001_ha, pMsg1, circularQ, bc);
+			done++;
+			if (++unpublished >= PM8001_OQ_CI_BATCH) {
+				mpi_msg_ci_publish(pm8001_ha, circularQ);
+				unpublished = 0;
+			}
 		}
 		if (MPI_IO_STATUS_BUSY == ret) {
 			/* Update the producer index from SPC */
@@ -6213,8 +7139,52 @@ static int process_oq(struct pm8001_hba_info *pm8001_ha)
 				/* OQ is empty */
 				break;
 		}
-	} while (1);
-	return ret;
+	}
+	mpi_msg_ci_publish(pm8001_ha, circularQ);
+	circularQ->iombs += done;
+	return done;
+}
+
+/**
+ * pm8001_coalesce_adapt - retune a queue's coalescing to its load
+ * @pm8001_ha: our hba card information
+ * @vec: the outbound queue, oq_lock held
+ *
+ * Once an interval, a queue completing more than PM8001_COAL_RATE IOMBs
+ * a second waits for a quarter of the I/O outstanding per queue, up to
+ * PM8001_COAL_ADAPT_COUNT; a quiet or shallow queue interrupts for
+ * every completion so a lone command is never held back.  The table
+ * update itself sleeps, so it is left to coal_work.
+ */
+static void pm8001_coalesce_adapt(struct pm8001_hba_info *pm8001_ha, u8 vec)
+{
+	struct outbound_queue_table *circularQ = &pm8001_ha->outbnd_q_tbl[vec];
+	unsigned long now = jiffies;
+	u32 count = 0, delay = 0, depth;
+	u64 rate;
+
+	if (!pm8001_ha->coal_adaptive || time_before(now, circularQ->coal_next))
+		return;
+	rate = div64_u64((circularQ->iombs - circularQ->coal_iombs) * HZ,
+		now - circularQ->coal_next + PM8001_COAL_INTERVAL);
+	circularQ->coal_iombs = circularQ->iombs;
+	circularQ->coal_next = now + PM8001_COAL_INTERVAL;
+	if (rate >= PM8001_COAL_RATE) {
+		depth = atomic_read(&pm8001_ha->tags_alloc) /
+			pm8001_ha->outbnd_q_num;
+		count = min_t(u32, depth / 4, PM8001_COAL_ADAPT_COUNT);
+		if (count > 1)
+			delay = PM8001_COAL_ADAPT_DELAY;
+		else
+			count = 0;
+	}
+	/* a change still queued must not land after this decision */
+	circularQ->coal_want = (count << 16) | delay;
+	if ((count == circularQ->coal_count) &&
+		(delay == circularQ->coal_delay))
+		return;
+	if (!test_and_set_bit(vec, &pm8001_ha->coal_dirty))
+		queue_work(pm8001_wq, &pm8001_ha->coal_work);
 }
 
 /* PCI_DMA_... to our direction translation. */
@@ -6290,7 +7260,7 @@ static int pm8001_chip_smp_req(struct pm8001_hba_info *pm8001_ha,
 	}
 
 	opc = OPC_INB_SMP_REQUEST;
-	circularQ = &pm8001_ha->inbnd_q_tbl[0];
+	circularQ = pm8001_inbnd_q_hipri(pm8001_ha);
 	smp_cmd->tag = cpu_to_le32(ccb->ccb_tag);
 	smp_cmd->long_smp_req.long_req_addr =
 		cpu_to_le64((u64)sg_dma_address(&task->smp_task.smp_req));
@@ -6301,12 +7271,14 @@ static int pm8001_chip_smp_req(struct pm8001_hba_info *pm8001_ha,
 	smp_cmd->long_smp_req.long_resp_size =
 		cpu_to_le32((u32)sg_dma_len(&task->smp_task.smp_resp)-4);
 	build_smp_cmd(pm8001_dev->device_id, smp_cmd->tag, smp_cmd);
+	/* account before posting; the completion may run on another cpu */
+	ccb->device = pm8001_dev;
+	INC_REQ(pm8001_dev, pm8001_ha);
 	rc = mpi_build_cmd(pm8001_ha, smp_cmd->tag, circularQ, opc, smp_cmd);
 	if (rc) {
+		DEC_REQ(pm8001_dev, pm8001_ha);
 		goto err_out_2;
 	}
-	ccb->device = pm8001_dev;
-	INC_REQ(pm8001_dev, pm8001_ha);
 	return 0;
 
 err_out_2:
@@ -6322,9 +7294,10 @@ err_out:
  * pm8001_chip_ssp_io_req - send a SSP task to FW
  * @pm8001_ha: our hba card information.
  * @ccb: the ccb information this request used.
+ * @plug: the submitter's batch, or NULL; it names the queue to post to
  */
 static int pm8001_chip_ssp_io_req(struct pm8001_hba_info *pm8001_ha,
-	struct pm8001_ccb_info *ccb)
+	struct pm8001_ccb_info *ccb, struct pm8001_iq_plug *plug)
 {
 	struct sas_task *task = ccb->task;
 	struct domain_device *dev = task->dev;
@@ -6350,13 +7323,14 @@ static int pm8001_chip_ssp_io_req(struct pm8001_hba_info *pm8001_ha,
 	ssp_cmd->ssp_iu.efb_prio_attr |= (task->ssp_task.task_prio << 3);
 	ssp_cmd->ssp_iu.efb_prio_attr |= (task->ssp_task.task_attr & 7);
 	memcpy(ssp_cmd->ssp_iu.cdb, task->ssp_task.cdb, 16);
-	circularQ = &pm8001_ha->inbnd_q_tbl[0];
+	circularQ = plug ? plug->circularQ : pm8001_inbnd_q_select(pm8001_ha);
 
 	/* fill in PRD (scatter/gather) table, if any */
 	if (task->num_scatter > 1) {
-		pm8001_chip_make_sg(task->scatter, ccb->n_elem, ccb->buf_prd);
-		phys_addr = ccb->ccb_dma_handle +
-			offsetof(struct pm8001_ccb_info, buf_prd[0]);
+		if (pm8001_sgl_get(pm8001_ha, ccb, ccb->n_elem))
+			return -ENOMEM;
+		pm8001_chip_make_sg(task->scatter, ccb->n_elem, ccb->sgl);
+		phys_addr = ccb->sgl_dma;
 		ssp_cmd->addr_low = cpu_to_le32(lower_32_bits(phys_addr));
 		ssp_cmd->addr_high = cpu_to_le32(upper_32_bits(phys_addr));
 		ssp_cmd->esgl = cpu_to_le32(1<<31);
@@ -6372,16 +7346,17 @@ static int pm8001_chip_ssp_io_req(struct pm8001_hba_info *pm8001_ha,
 		ssp_cmd->len = cpu_to_le32(task->total_xfer_len);
 		ssp_cmd->esgl = 0;
 	}
-	ret = mpi_build_cmd(pm8001_ha, tag, circularQ, opc, ssp_cmd);
-	if (ret == 0) {
-		ccb->device = pm8001_dev;
-		INC_REQ(pm8001_dev, pm8001_ha);
-	}
+	ccb->device = pm8001_dev;
+	INC_REQ(pm8001_dev, pm8001_ha);
+	ret = mpi_build_cmd_plug(pm8001_ha, tag, circularQ, opc, ssp_cmd,
+		plug);
+	if (ret)
+		DEC_REQ(pm8001_dev, pm8001_ha);
 	return ret;
 }
 
 static int pm8001_chip_sata_req(struct pm8001_hba_info *pm8001_ha,
-	struct pm8001_ccb_info *ccb)
+	struct pm8001_ccb_info *ccb, struct pm8001_iq_plug *plug)
 {
 	struct sas_task *task = ccb->task;
 	struct domain_device *dev = task->dev;
@@ -6398,7 +7373,7 @@ static int pm8001_chip_sata_req(struct pm8001_hba_info *pm8001_ha,
 	if (unlikely(!pm8001_dev))
 		return -EINVAL;
 	memset(sata_cmd, 0, sizeof(*sata_cmd));
-	circularQ = &pm8001_ha->inbnd_q_tbl[0];
+	circularQ = plug ? plug->circularQ : pm8001_inbnd_q_select(pm8001_ha);
 	if (task->data_dir == PCI_DMA_NONE) {
 		ATAP = 0x04;  /* no data*/
 		PM8001_IO_DBG(pm8001_ha, pm8001_printk("no data\n"));
@@ -6430,9 +7405,10 @@ static int pm8001_chip_sata_req(struct pm8001_hba_info *pm8001_ha,
 	sata_cmd->sata_fis.flags &= 0xF0;/* PM_PORT field shall be 0 */
 	/* fill in PRD (scatter/gather) table, if any */
 	if (task->num_scatter > 1) {
-		pm8001_chip_make_sg(task->scatter, ccb->n_elem, ccb->buf_prd);
-		phys_addr = ccb->ccb_dma_handle +
-			offsetof(struct pm8001_ccb_info, buf_prd[0]);
+		if (pm8001_sgl_get(pm8001_ha, ccb, ccb->n_elem))
+			return -ENOMEM;
+		pm8001_chip_make_sg(task->scatter, ccb->n_elem, ccb->sgl);
+		phys_addr = ccb->sgl_dma;
 		sata_cmd->addr_low = lower_32_bits(phys_addr);
 		sata_cmd->addr_high = upper_32_bits(phys_addr);
 		sata_cmd->esgl = cpu_to_le32(1 << 31);
@@ -6448,11 +7424,12 @@ static int pm8001_chip_sata_req(struct pm8001_hba_info *pm8001_ha,
 		sata_cmd->len = cpu_to_le32(task->total_xfer_len);
 		sata_cmd->esgl = 0;
 	}
-	ret = mpi_build_cmd(pm8001_ha, tag, circularQ, opc, sata_cmd);
-	if (ret == 0) {
-		ccb->device = pm8001_dev;
-		INC_REQ(pm8001_dev, pm8001_ha);
-	}
+	ccb->device = pm8001_dev;
+	INC_REQ(pm8001_dev, pm8001_ha);
+	ret = mpi_build_cmd_plug(pm8001_ha, tag, circularQ, opc, sata_cmd,
+		plug);
+	if (ret)
+		DEC_REQ(pm8001_dev, pm8001_ha);
 	return ret;
 }
 
@@ -6471,7 +7448,7 @@ pm8001_chip_phy_start_req(struct pm8001_hba_info *pm8001_ha, u8 phy_id)
 	int ret;
 	u32 tag;
 	u32 opcode = OPC_INB_PHYSTART;
-	circularQ = &pm8001_ha->inbnd_q_tbl[0];
+	circularQ = pm8001_inbnd_q_select(pm8001_ha);
 
 	if (pm8001_tag_alloc(pm8001_ha, &tag))
 		return -ENOMEM;
@@ -6519,7 +7496,7 @@ static int pm8001_chip_phy_stop_req(struct pm8001_hba_info *pm8001_ha,
 	int ret;
 	u32 tag;
 	u32 opcode = OPC_INB_PHYSTOP;
-	circularQ = &pm8001_ha->inbnd_q_tbl[0];
+	circularQ = pm8001_inbnd_q_select(pm8001_ha);
 
 	if (pm8001_tag_alloc(pm8001_ha, &tag))
 		return -ENOMEM;
@@ -6555,7 +7532,7 @@ static int pm8001_chip_reg_dev_req(struct pm8001_hba_info *pm8001_ha,
 	u16 ITNT = 2000;
 	struct domain_device *dev = pm8001_dev->sas_device;
 	struct domain_device *parent_dev = dev->parent;
-	circularQ = &pm8001_ha->inbnd_q_tbl[0];
+	circularQ = pm8001_inbnd_q_hipri(pm8001_ha);
 
 	rc = pm8001_tag_alloc(pm8001_ha, &tag);
 	if (rc)
@@ -6592,11 +7569,11 @@ static int pm8001_chip_reg_dev_req(struct pm8001_hba_info *pm8001_ha,
 		cpu_to_le32(ITNT | (firstBurstSize * 0x10000));
 	memcpy(payload->sas_addr, pm8001_dev->sas_device->sas_addr,
 		SAS_ADDR_SIZE);
+	ccb->device = pm8001_dev;
+	INC_REQ(pm8001_dev, pm8001_ha);
 	rc = mpi_build_cmd(pm8001_ha, tag, circularQ, opc, payload);
-	if (rc == 0) {
-		ccb->device = pm8001_dev;
-		INC_REQ(pm8001_dev, pm8001_ha);
-	} else {
+	if (rc) {
+		DEC_REQ(pm8001_dev, pm8001_ha);
 		pm8001_tag_free(pm8001_ha, tag);
 	}
 	return rc;
@@ -6615,7 +7592,7 @@ static int pm8001_chip_dereg_dev_req(struct pm8001_hba_info *pm8001_ha,
 	struct pm8001_ccb_info *ccb;
 	u32 tag;
 
-	circularQ = &pm8001_ha->inbnd_q_tbl[0];
+	circularQ = pm8001_inbnd_q_hipri(pm8001_ha);
 	ret = pm8001_tag_alloc(pm8001_ha, &tag);
 	if (ret)
 		return ret;
@@ -6652,7 +7629,7 @@ static int pm8001_chip_phy_ctl_req(struct pm8001_hba_info *pm8001_ha,
 	struct pm8001_ccb_info *ccb;
 	u32 tag;
 
-	circularQ = &pm8001_ha->inbnd_q_tbl[0];
+	circularQ = pm8001_inbnd_q_select(pm8001_ha);
 	ret = pm8001_tag_alloc(pm8001_ha, &tag);
 	if (ret)
 		return ret;
@@ -6686,21 +7663,160 @@ static u32 pm8001_chip_is_our_interupt(struct pm8001_hba_info *pm8001_ha)
 /**
  * pm8001_chip_isr - PM8001 isr handler.
  * @pm8001_ha: our hba card information.
- * @irq: irq number.
- * @stat: stat.
+ * @vec: the vector that fired; only its outbound queue is drained.
+ *
+ * Used when completions are handled in hard irq context, where there is
+ * nothing to come back later, so the queue is drained to empty.
  */
 static irqreturn_t
-pm8001_chip_isr(struct pm8001_hba_info *pm8001_ha)
+pm8001_chip_isr(struct pm8001_hba_info *pm8001_ha, u8 vec)
 {
+	struct outbound_queue_table *circularQ = &pm8001_ha->outbnd_q_tbl[vec];
 	unsigned long flags;
-	spin_lock_irqsave(&pm8001_ha->lock, flags);
+
+	/* only this vector's queue lock; slow opcodes take ha->lock inside */
+	local_irq_save(flags);
+	pm8001_spin_lock_counted(&circularQ->oq_lock, &circularQ->oq_contended);
+	circularQ->irqs++;
+#ifdef PM8001_USE_MSIX
+	pm8001_chip_msix_interrupt_disable(pm8001_ha, vec);
+	process_oq(pm8001_ha, vec, INT_MAX);
+	pm8001_coalesce_adapt(pm8001_ha, vec);
+	pm8001_chip_msix_interrupt_enable(pm8001_ha, vec);
+#else
 	pm8001_chip_interrupt_disable(pm8001_ha);
-	process_oq(pm8001_ha);
+	process_oq(pm8001_ha, vec, INT_MAX);
+	pm8001_coalesce_adapt(pm8001_ha, vec);
 	pm8001_chip_interrupt_enable(pm8001_ha);
-	spin_unlock_irqrestore(&pm8001_ha->lock, flags);
+#endif
+	spin_unlock(&circularQ->oq_lock);
+	/* no IPIs from hard irq context, so complete everything here */
+	pm8001_task_done_flush(pm8001_ha, NULL);
+	local_irq_restore(flags);
 	return IRQ_HANDLED;
 }
 
+/**
+ * pm8001_chip_isr_mask - quiet a vector until its queue has been polled
+ * @pm8001_ha: our hba card information.
+ * @vec: the vector that fired.
+ *
+ * Called from the hard irq handler before the poll is scheduled, so an
+ * interrupt is not raised for every completion posted meanwhile.
+ */
+static void
+pm8001_chip_isr_mask(struct pm8001_hba_info *pm8001_ha, u8 vec)
+{
+	/* only this vector's handler touches the count */
+	pm8001_ha->outbnd_q_tbl[vec].irqs++;
+#ifdef PM8001_USE_MSIX
+	pm8001_chip_msix_interrupt_disable(pm8001_ha, vec);
+#else
+	pm8001_chip_interrupt_disable(pm8001_ha);
+#endif
+}
+
+/**
+ * pm8001_chip_isr_poll - one budgeted pass over an outbound queue
+ * @pm8001_ha: our hba card information.
+ * @vec: the vector, masked by pm8001_chip_isr_mask, to poll.
+ * @budget: most IOMBs to handle in this pass.
+ *
+ * The vector is unmasked only once the queue has been found empty; if the
+ * budget runs out it stays masked and the caller must poll again.  Any
+ * completion posted between the last producer index read and the unmask
+ * is left pending in the chip and raises a fresh interrupt.
+ *
+ * Returns the number of IOMBs handled.
+ */
+static int
+pm8001_chip_isr_poll(struct pm8001_hba_info *pm8001_ha, u8 vec, int budget)
+{
+	struct outbound_queue_table *circularQ = &pm8001_ha->outbnd_q_tbl[vec];
+	struct pm8001_done_kick kick;
+	unsigned long flags;
+	int done;
+
+	kick.n = 0;
+	local_irq_save(flags);
+	pm8001_spin_lock_counted(&circularQ->oq_lock, &circularQ->oq_contended);
+	done = process_oq(pm8001_ha, vec, budget);
+	circularQ->poll_passes++;
+	if (done > circularQ->poll_max)
+		circularQ->poll_max = done;
+	if (done < budget) {
+		pm8001_coalesce_adapt(pm8001_ha, vec);
+#ifdef PM8001_USE_MSIX
+		pm8001_chip_msix_interrupt_enable(pm8001_ha, vec);
+#else
+		pm8001_chip_interrupt_enable(pm8001_ha);
+#endif
+	} else
+		circularQ->poll_exhausted++;
+	spin_unlock(&circularQ->oq_lock);
+	pm8001_task_done_flush(pm8001_ha, &kick);
+	local_irq_restore(flags);
+	pm8001_task_done_kick(pm8001_ha, &kick);
+	return done;
+}
+
+/**
+ * pm8001_chip_oq_spin - reap completions from the submitting context
+ * @pm8001_ha: our hba card information.
+ * @ccb: an I/O just posted.
+ * @tag: the tag it was posted with.
+ *
+ * Watches the producer index of the queue the I/O was told to answer on
+ * (ccb->oq, not this cpu's, which may have changed since the post) for
+ * up to spin_usecs and drains it whenever it moves, until @ccb's tag has
+ * been released.  Should the ccb already have been reused, the tag check
+ * ends the spin at once.  If the time runs out the I/O is left to the
+ * interrupt; if the poller already holds the queue the spin just waits
+ * for it.
+ *
+ * Returns the number of IOMBs this context handled.
+ */
+static int
+pm8001_chip_oq_spin(struct pm8001_hba_info *pm8001_ha,
+	struct pm8001_ccb_info *ccb, u32 tag)
+{
+	u8 vec = ccb->oq;
+	struct outbound_queue_table *circularQ = &pm8001_ha->outbnd_q_tbl[vec];
+	ktime_t deadline = ktime_add_us(ktime_get(), pm8001_ha->spin_usecs);
+	struct pm8001_done_kick kick;
+	unsigned long flags;
+	int done = 0;
+
+	kick.n = 0;
+	for (;;) {
+		if (pm8001_read_32(circularQ->pi_virt) !=
+			circularQ->consumer_idx) {
+			local_irq_save(flags);
+			if (spin_trylock(&circularQ->oq_lock)) {
+				circularQ->spinning = 1;
+				done += process_oq(pm8001_ha, vec,
+					pm8001_ha->poll_budget);
+				circularQ->spinning = 0;
+				spin_unlock(&circularQ->oq_lock);
+				pm8001_task_done_flush(pm8001_ha, &kick);
+			}
+			local_irq_restore(flags);
+			pm8001_task_done_kick(pm8001_ha, &kick);
+		}
+		if ((ccb->ccb_tag != tag) ||
+			!test_bit(TAG_IDX_MASK(tag), pm8001_ha->tags)) {
+			atomic_inc(&pm8001_ha->spin_hits);
+			break;
+		}
+		if (ktime_to_ns(ktime_sub(deadline, ktime_get())) <= 0) {
+			atomic_inc(&pm8001_ha->spin_misses);
+			break;
+		}
+		cpu_relax();
+	}
+	return done;
+}
+
 static int send_task_abort(struct pm8001_hba_info *pm8001_ha, u32 opc,
 	u32 dev_id, u8 flag, u32 task_tag, u32 cmd_tag)
 {
@@ -6709,7 +7825,7 @@ static int send_task_abort(struct pm8001_hba_info *pm8001_ha, u32 opc,
 	struct inbound_queue_table *circularQ;
 	int ret;
 	BUG_ON(ccb->ccb_tag != cmd_tag);
-	circularQ = &pm8001_ha->inbnd_q_tbl[0];
+	circularQ = pm8001_inbnd_q_hipri(pm8001_ha);
 	memset(task_abort, 0, sizeof(*task_abort));
 	if (ABORT_SINGLE == (flag & ABORT_MASK)) {
 		task_abort->abort_all = 0;
@@ -6744,13 +7860,13 @@ static int pm8001_chip_abort_task(struct pm8001_hba_info *pm8001_ha,
 	else
 		opc = OPC_INB_SMP_ABORT;/* SMP */
 	device_id = pm8001_dev->device_id;
+	/* the caller will have pointed ccb->device at us */
+	INC_REQ(pm8001_dev, pm8001_ha);
 	rc = send_task_abort(pm8001_ha, opc, device_id, abort_all? ABORT_ALL : ABORT_SINGLE,
 		task_tag, cmd_tag);
 	if (rc) {
+		DEC_REQ(pm8001_dev, pm8001_ha);
 		PM8001_EH_DBG(pm8001_ha, pm8001_printk("rc= %d\n", rc));
-	} else {
-		/* the caller will have pointed ccb->device at us */
-		INC_REQ(pm8001_dev, pm8001_ha);
 	}
 	return rc;
 }
@@ -6780,12 +7896,12 @@ static int pm8001_chip_ssp_tm_req(struct pm8001_hba_info *pm8001_ha,
 	sspTMCmd->tmf = cpu_to_le32(tmf->tmf);
 	memcpy(sspTMCmd->lun, task->ssp_task.LUN, 8);
 	sspTMCmd->tag = cpu_to_le32(ccb->ccb_tag);
-	circularQ = &pm8001_ha->inbnd_q_tbl[0];
+	circularQ = pm8001_inbnd_q_hipri(pm8001_ha);
+	/* the caller will have pointed ccb->device at us */
+	INC_REQ(pm8001_dev, pm8001_ha);
 	ret = mpi_build_cmd(pm8001_ha, ccb->ccb_tag, circularQ, opc, sspTMCmd);
-	if (ret == 0) {
-		/* the caller will have pointed ccb->device at us */
-		INC_REQ(pm8001_dev, pm8001_ha);
-	}
+	if (ret)
+		DEC_REQ(pm8001_dev, pm8001_ha);
 	return ret;
 }
 
@@ -6808,7 +7924,7 @@ static int pm8001_chip_get_nvmd_req(struct pm8001_hba_info *pm8001_ha,
 		return -ENOMEM;
 	fw_control_context->usrAddr = (u8 *)&ioctl_payload->func_specific[0];
 	fw_control_context->len = ioctl_payload->length;
-	circularQ = &pm8001_ha->inbnd_q_tbl[0];
+	circularQ = pm8001_inbnd_q_select(pm8001_ha);
 	rc = pm8001_tag_alloc(pm8001_ha, &tag);
 	if (rc) {
 		PMFREE(fw_control_context, sizeof(struct fw_control_ex));
@@ -6892,7 +8008,7 @@ static int pm8001_chip_set_nvmd_req(struct pm8001_hba_info *pm8001_ha,
 	fw_control_context = PMALLOC(sizeof(struct fw_control_ex), GFP_KERNEL);
 	if (!fw_control_context)
 		return -ENOMEM;
-	circularQ = &pm8001_ha->inbnd_q_tbl[0];
+	circularQ = pm8001_inbnd_q_select(pm8001_ha);
 	memcpy(pm8001_ha->memoryMap.region[NVMD].virt_ptr,
 		ioctl_payload->func_specific,
 		ioctl_payload->length);
@@ -6980,7 +8096,7 @@ pm8001_chip_fw_flash_update_build(struct pm8001_hba_info *pm8001_ha,
 	ccb = get_ccb_array(pm8001_ha, tag);
 	payload = (struct fw_flash_Update_req *) ccb->cmd;
 	memset(payload, 0, sizeof(*payload));
-	circularQ = &pm8001_ha->inbnd_q_tbl[0];
+	circularQ = pm8001_inbnd_q_select(pm8001_ha);
 	info = fw_flash_updata_info;
 	payload->tag = cpu_to_le32(tag);
 	payload->cur_image_len = cpu_to_le32(info->cur_image_len);
@@ -7075,15 +8191,15 @@ pm8001_chip_set_dev_state_req(struct pm8001_hba_info *pm8001_ha,
 	payload = (struct set_dev_state_req *) ccb->cmd;
 	memset(payload, 0, sizeof(*payload));
 	ccb->ccb_tag = tag;
-	circularQ = &pm8001_ha->inbnd_q_tbl[0];
+	circularQ = pm8001_inbnd_q_hipri(pm8001_ha);
 	payload->tag = cpu_to_le32(tag);
 	payload->device_id = cpu_to_le32(pm8001_dev->device_id);
 	payload->nds = cpu_to_le32(state);
+	ccb->device = pm8001_dev;
+	INC_REQ(pm8001_dev, pm8001_ha);
 	rc = mpi_build_cmd(pm8001_ha, tag, circularQ, opc, payload);
-	if (rc == 0) {
-		ccb->device = pm8001_dev;
-		INC_REQ(pm8001_dev, pm8001_ha);
-	} else {
+	if (rc) {
+		DEC_REQ(pm8001_dev, pm8001_ha);
 		pm8001_tag_free(pm8001_ha, tag);
 	}
 	return rc;
@@ -7107,7 +8223,7 @@ pm8001_chip_sas_re_initialization(struct pm8001_hba_info *pm8001_ha)
 	memset(payload, 0, sizeof(*payload));
 	ccb->device = NULL;
 	ccb->ccb_tag = tag;
-	circularQ = &pm8001_ha->inbnd_q_tbl[0];
+	circularQ = pm8001_inbnd_q_select(pm8001_ha);
 	payload->tag = cpu_to_le32(tag);
 	payload->SSAHOLT = cpu_to_le32(0xd << 25);
 	payload->sata_hol_tmo = cpu_to_le32(80);
@@ -7129,10 +8245,14 @@ const struct pm8001_dispatch pm8001_8001_dispatch = {
 	.chip_iounmap		= pm8001_chip_iounmap,
 	.isr			= pm8001_chip_isr,
 	.is_our_interupt	= pm8001_chip_is_our_interupt,
-	.isr_process_oq		= process_oq,
+	.isr_mask		= pm8001_chip_isr_mask,
+	.isr_poll		= pm8001_chip_isr_poll,
+	.oq_spin		= pm8001_chip_oq_spin,
 	.interrupt_enable 	= pm8001_chip_interrupt_enable,
 	.interrupt_disable	= pm8001_chip_interrupt_disable,
 	.make_prd		= pm8001_chip_make_sg,
+	.iq_plug		= pm8001_chip_iq_plug,
+	.iq_unplug		= pm8001_chip_iq_unplug,
 	.smp_req		= pm8001_chip_smp_req,
 	.ssp_io_req		= pm8001_chip_ssp_io_req,
 	.sata_req		= pm8001_chip_sata_req,
@@ -58,6 +58,17 @@ static ulong pm8001_wwn_by4;
 static ulong pm8001_wwn_by8;
 static int pm8001_scsi_ehandler = 1;
 static int pm8001_disable;
+static int pm8001_doorbell_batch = 32;
+static int pm8001_poll_budget = 64;
+static int pm8001_coalesce;
+static int pm8001_coalesce_count = 10;
+static int pm8001_coalesce_delay;
+static int pm8001_spin_usecs;
+static int pm8001_steer_completions;
+static int pm8001_orej_backoff = 1;
+static int pm8001_stall_timeout = PM8001_STALL_MS;
+static int pm8001_max_ccb = PM8001_DEF_CCB;
+static int pm8001_queue_depth = PM8001_MPI_QUEUE_DEF;
 
 LIST_HEAD(hba_list);
 
@@ -158,6 +169,14 @@ static void pm8001_free(struct pm8001_hba_info *pm8001_ha)
 	if (!pm8001_ha)
 		return;
 
+	/* the scan walks the device table freed below */
+	pm8001_stall_stop(pm8001_ha);
+	pm8001_orej_stop(pm8001_ha);
+	/* and this writes to the config table unmapped below */
+	cancel_work_sync(&pm8001_ha->coal_work);
+	/* queued retries and stall checks look into the ccb arrays */
+	flush_workqueue(pm8001_wq);
+
 	for (i = 0; i < USI_MAX_MEMCNT; i++) {
 		if (pm8001_ha->memoryMap.region[i].virt_ptr != NULL) {
 			pci_free_consistent(pm8001_ha->pdev,
@@ -169,19 +188,41 @@ static void pm8001_free(struct pm8001_hba_info *pm8001_ha)
 	PM8001_CHIP_DISP->chip_iounmap(pm8001_ha);
 	if (pm8001_ha->shost)
 		scsi_host_put(pm8001_ha->shost);
-	flush_workqueue(pm8001_wq);
-	PMFREE(pm8001_ha->tags, PM8001_MAX_CCB);
+	pm8001_work_pool_free(pm8001_ha);
+	PMFREE(pm8001_ha->tags,
+		BITS_TO_LONGS(pm8001_ha->ccb_count) * sizeof(long));
+	if (pm8001_ha->tags_hint)
+		free_percpu(pm8001_ha->tags_hint);
+	if (pm8001_ha->cpu_oq)
+		free_percpu(pm8001_ha->cpu_oq);
+	if (pm8001_ha->done_batch)
+		free_percpu(pm8001_ha->done_batch);
+	pm8001_sgl_pool_free(pm8001_ha);
 	PMFREE(pm8001_ha, sizeof(struct pm8001_hba_info));
 }
 
 #ifdef PM8001_USE_TASKLET
+/**
+ * pm8001_tasklet - poll a masked vector's outbound queue.
+ * @opaque: the vector context.
+ *
+ * Each run handles at most poll_budget IOMBs.  If the budget is used up
+ * the tasklet reschedules itself and the vector stays masked, so other
+ * softirqs get in between passes and a sustained load is pushed out to
+ * ksoftirqd rather than holding the cpu.
+ */
 static void pm8001_tasklet(unsigned long opaque)
 {
-	struct pm8001_hba_info *pm8001_ha;
-	pm8001_ha = (struct pm8001_hba_info *)opaque;
+	struct isr_param *irq_vector = (struct isr_param *)opaque;
+	struct pm8001_hba_info *pm8001_ha = irq_vector->drv_inst;
+	int budget;
+
 	if (unlikely(!pm8001_ha))
 		BUG_ON(1);
-	PM8001_CHIP_DISP->isr(pm8001_ha);
+	budget = pm8001_ha->poll_budget;
+	if (PM8001_CHIP_DISP->isr_poll(pm8001_ha, irq_vector->irq_id,
+		budget) >= budget)
+		tasklet_schedule(&pm8001_ha->tasklet[irq_vector->irq_id]);
 }
 #endif
 
@@ -190,26 +231,55 @@ static void pm8001_tasklet(unsigned long opaque)
   * pm8001_interrupt - when HBA originate a interrupt,we should invoke this
   * dispatcher to handle each case.
   * @irq: irq number.
-  * @opaque: the passed general host adapter struct
+  * @opaque: the vector context, names the hba and the queue to drain
   */
 static irqreturn_t pm8001_interrupt(int irq, void *opaque EXTRA_IRQ_ARGS)
 {
 	struct pm8001_hba_info *pm8001_ha;
 	irqreturn_t ret = IRQ_HANDLED;
-	struct sas_ha_struct *sha = opaque;
-	pm8001_ha = sha->lldd_ha;
+	struct isr_param *irq_vector = opaque;
+	pm8001_ha = irq_vector->drv_inst;
 	if (unlikely(!pm8001_ha))
 		return IRQ_NONE;
 	if (!PM8001_CHIP_DISP->is_our_interupt(pm8001_ha))
 		return IRQ_NONE;
 #ifdef PM8001_USE_TASKLET
-	tasklet_schedule(&pm8001_ha->tasklet);
+	PM8001_CHIP_DISP->isr_mask(pm8001_ha, irq_vector->irq_id);
+	tasklet_schedule(&pm8001_ha->tasklet[irq_vector->irq_id]);
 #else
-	ret = PM8001_CHIP_DISP->isr(pm8001_ha);
+	ret = PM8001_CHIP_DISP->isr(pm8001_ha, irq_vector->irq_id);
 #endif
 	return ret;
 }
 
+static struct lock_class_key pm8001_oq_lock_key[PM8001_MAX_OUTB_NUM];
+static struct lock_class_key pm8001_iq_lock_key[PM8001_MAX_INB_NUM];
+
+/**
+ * pm8001_outbnd_q_count - how many outbound queues this hba can steer.
+ * @pm8001_ha: our hba structure.
+ *
+ * One outbound queue per MSI-X vector, no more vectors than the device's
+ * MSI-X table holds or than there are cpus to spread them over.
+ */
+static u32 pm8001_outbnd_q_count(struct pm8001_hba_info *pm8001_ha)
+{
+#ifdef PM8001_USE_MSIX
+	int pos;
+	u16 control;
+
+	pos = pci_find_capability(pm8001_ha->pdev, PCI_CAP_ID_MSIX);
+	if (pos) {
+		pci_read_config_word(pm8001_ha->pdev, pos + PCI_MSIX_FLAGS,
+			&control);
+		return min_t(u32, min_t(u32, num_online_cpus(),
+			(control & PCI_MSIX_FLAGS_QSIZE) + 1),
+			min_t(u32, PM8001_MAX_OUTB_NUM, PM8001_MAX_MSIX_VEC));
+	}
+#endif
+	return 1;
+}
+
 /**
  * pm8001_alloc - initiate our hba structure and 6 DMAs area.
  * @pm8001_ha:our hba structure.
@@ -218,7 +288,57 @@ static irqreturn_t pm8001_interrupt(int irq, void *opaque EXTRA_IRQ_ARGS)
 static int __devinit pm8001_alloc(struct pm8001_hba_info *pm8001_ha)
 {
 	int i;
+	u32 depth;
 	spin_lock_init(&pm8001_ha->lock);
+	init_completion(&pm8001_ha->phy_start_done);
+	init_completion(&pm8001_ha->phy_up_done);
+	pm8001_orej_init(pm8001_ha);
+	pm8001_stall_init(pm8001_ha);
+	pm8001_coalesce_init(pm8001_ha);
+	/*
+	 * ccbs and ring depth come from the module parameters; the firmware's
+	 * max_out_io can only trim the usable tags once it is running.
+	 */
+#if (PM8001_MAX_CCB_ARRAY == 1)
+	pm8001_ha->ccb_count = clamp_t(u32, pm8001_max_ccb, PM8001_MIN_CCB,
+		PM8001_MAX_CCB);
+#else
+	/* the ccb arrays are fixed size */
+	pm8001_ha->ccb_count = PM8001_MAX_CCB;
+#endif
+	/*
+	 * the high priority queue, then one inbound queue per cpu up to what
+	 * the MPI table can describe
+	 */
+	pm8001_ha->inbnd_q_num = min_t(u32, num_online_cpus(),
+		PM8001_MAX_INB_NUM - 1) + 1;
+	for (i = 0; i < pm8001_ha->inbnd_q_num; i++) {
+		spin_lock_init(&pm8001_ha->inbnd_q_tbl[i].iq_lock);
+		/* and these, after the host lock */
+		lockdep_set_class(&pm8001_ha->inbnd_q_tbl[i].iq_lock,
+			&pm8001_iq_lock_key[i]);
+	}
+	pm8001_ha->outbnd_q_num = pm8001_outbnd_q_count(pm8001_ha);
+	for (i = 0; i < pm8001_ha->outbnd_q_num; i++) {
+		spin_lock_init(&pm8001_ha->outbnd_q_tbl[i].oq_lock);
+		/* pm8001_lock_all nests these, always in index order */
+		lockdep_set_class(&pm8001_ha->outbnd_q_tbl[i].oq_lock,
+			&pm8001_oq_lock_key[i]);
+	}
+	depth = roundup_pow_of_two(clamp_t(u32, pm8001_queue_depth,
+		PM8001_MPI_QUEUE_MIN, PM8001_MPI_QUEUE_MAX));
+	pm8001_ha->mpi_queue_depth = depth;
+	/* all the queues of one direction must fit the one region */
+	while ((pm8001_ha->mpi_queue_depth > PM8001_MPI_QUEUE_MIN) &&
+	       ((pm8001_ha->mpi_queue_depth * 64 * max(pm8001_ha->inbnd_q_num,
+		pm8001_ha->outbnd_q_num) + 64) > PM8001_MPI_REGION_MAX))
+		pm8001_ha->mpi_queue_depth >>= 1;
+	if (pm8001_ha->mpi_queue_depth < depth)
+		PM8001_INIT_DBG(pm8001_ha,
+			pm8001_printk("queue depth %u for %u/%u queues\n",
+			pm8001_ha->mpi_queue_depth, pm8001_ha->inbnd_q_num,
+			pm8001_ha->outbnd_q_num));
+	pm8001_ha->mpi_queue_mask = pm8001_ha->mpi_queue_depth - 1;
 	for (i = 0; i < pm8001_ha->chip->n_phy; i++) {
 		pm8001_phy_init(pm8001_ha, i);
 		pm8001_ha->port[i].wide_port_phymap = 0;
@@ -227,9 +347,24 @@ static int __devinit pm8001_alloc(struct pm8001_hba_info *pm8001_ha)
 		INIT_LIST_HEAD(&pm8001_ha->port[i].list);
 	}
 
-	pm8001_ha->tags = PMALLOC(PM8001_MAX_CCB, GFP_KERNEL);
+	pm8001_ha->tags = PMALLOC(BITS_TO_LONGS(pm8001_ha->ccb_count) *
+		sizeof(long), GFP_KERNEL);
 	if (!pm8001_ha->tags)
 		goto err_out;
+	pm8001_ha->tags_hint = alloc_percpu(unsigned int);
+	if (!pm8001_ha->tags_hint)
+		goto err_out;
+	pm8001_ha->cpu_oq = alloc_percpu(u8);
+	if (!pm8001_ha->cpu_oq)
+		goto err_out;
+	pm8001_ha->done_batch = alloc_percpu(struct pm8001_done_batch);
+	if (!pm8001_ha->done_batch)
+		goto err_out;
+	for_each_possible_cpu(i)
+		spin_lock_init(&per_cpu_ptr(pm8001_ha->done_batch,
+			i)->remote_lock);
+	if (pm8001_sgl_pool_init(pm8001_ha))
+		goto err_out;
 	pm8001_logging_size = ((pm8001_logging_size + 31) / 32) * 32;
 	if (pm8001_logging_size < 64)
 		pm8001_logging_size = 64;
@@ -246,27 +381,31 @@ static int __devinit pm8001_alloc(struct pm8001_hba_info *pm8001_ha)
 	pm8001_ha->memoryMap.region[IOP].alignment = 32;
 
 	/* MPI Memory region 3 for consumer Index of inbound queues */
-	pm8001_ha->memoryMap.region[CI].num_elements = 1;
+	pm8001_ha->memoryMap.region[CI].num_elements = pm8001_ha->inbnd_q_num;
 	pm8001_ha->memoryMap.region[CI].element_size = 4;
-	pm8001_ha->memoryMap.region[CI].total_len = 4;
+	pm8001_ha->memoryMap.region[CI].total_len = 4 * pm8001_ha->inbnd_q_num;
 	pm8001_ha->memoryMap.region[CI].alignment = 4;
 
 	/* MPI Memory region 4 for producer Index of outbound queues */
-	pm8001_ha->memoryMap.region[PI].num_elements = 1;
+	pm8001_ha->memoryMap.region[PI].num_elements = pm8001_ha->outbnd_q_num;
 	pm8001_ha->memoryMap.region[PI].element_size = 4;
-	pm8001_ha->memoryMap.region[PI].total_len = 4;
+	pm8001_ha->memoryMap.region[PI].total_len = 4 * pm8001_ha->outbnd_q_num;
 	pm8001_ha->memoryMap.region[PI].alignment = 4;
 
-	/* MPI Memory region 5 inbound queues */
-	pm8001_ha->memoryMap.region[IB].num_elements = PM8001_MPI_QUEUE;
+	/* MPI Memory region 5 inbound queues, carved up per queue */
+	pm8001_ha->memoryMap.region[IB].num_elements =
+		pm8001_ha->mpi_queue_depth * pm8001_ha->inbnd_q_num;
 	pm8001_ha->memoryMap.region[IB].element_size = 64;
-	pm8001_ha->memoryMap.region[IB].total_len = PM8001_MPI_QUEUE * 64;
+	pm8001_ha->memoryMap.region[IB].total_len =
+		pm8001_ha->mpi_queue_depth * 64 * pm8001_ha->inbnd_q_num;
 	pm8001_ha->memoryMap.region[IB].alignment = 64;
 
-	/* MPI Memory region 6 outbound queues */
-	pm8001_ha->memoryMap.region[OB].num_elements = PM8001_MPI_QUEUE;
+	/* MPI Memory region 6 outbound queues, carved up per queue */
+	pm8001_ha->memoryMap.region[OB].num_elements =
+		pm8001_ha->mpi_queue_depth * pm8001_ha->outbnd_q_num;
 	pm8001_ha->memoryMap.region[OB].element_size = 64;
-	pm8001_ha->memoryMap.region[OB].total_len = PM8001_MPI_QUEUE * 64;
+	pm8001_ha->memoryMap.region[OB].total_len =
+		pm8001_ha->mpi_queue_depth * 64 * pm8001_ha->outbnd_q_num;
 	pm8001_ha->memoryMap.region[OB].alignment = 64;
 
 	/* Memory region write DMA*/
@@ -283,10 +422,11 @@ static int __devinit pm8001_alloc(struct pm8001_hba_info *pm8001_ha)
 #if (PM8001_MAX_CCB_ARRAY == 1)
 	/* Memory region for ccb_info*/
 	pm8001_ha->memoryMap.region[CCB_MEM].num_elements = 1;
-	pm8001_ha->memoryMap.region[CCB_MEM].element_size = PM8001_MAX_CCB *
-		sizeof(struct pm8001_ccb_info);
-	pm8001_ha->memoryMap.region[CCB_MEM].total_len = PM8001_MAX_CCB *
-		sizeof(struct pm8001_ccb_info);
+	pm8001_ha->memoryMap.region[CCB_MEM].element_size =
+		pm8001_ha->ccb_count * sizeof(struct pm8001_ccb_info);
+	pm8001_ha->memoryMap.region[CCB_MEM].total_len =
+		pm8001_ha->ccb_count * sizeof(struct pm8001_ccb_info);
+	pm8001_ha->memoryMap.region[CCB_MEM].alignment = L1_CACHE_BYTES;
 #else
 	for (i = 0; i < PM8001_MAX_CCB_ARRAY; i++) {
 		/* Memory region for ccb_info*/
@@ -295,6 +435,8 @@ static int __devinit pm8001_alloc(struct pm8001_hba_info *pm8001_ha)
 			PM8001_CCB_PER_ARRAY *	sizeof(struct pm8001_ccb_info);
 		pm8001_ha->memoryMap.region[CCB_MEM + i].total_len =
 		PM8001_CCB_PER_ARRAY * sizeof(struct pm8001_ccb_info);
+		pm8001_ha->memoryMap.region[CCB_MEM + i].alignment =
+			L1_CACHE_BYTES;
 	}
 #endif
 
@@ -320,18 +462,17 @@ static int __devinit pm8001_alloc(struct pm8001_hba_info *pm8001_ha)
 		pm8001_ha->devices[i].dev_type = NO_DEVICE;
 		pm8001_ha->devices[i].id = i;
 		pm8001_ha->devices[i].device_id = PM8001_MAX_DEVICES;
-		pm8001_ha->devices[i].running_req = 0;
+		atomic_set(&pm8001_ha->devices[i].running_req, 0);
+		pm8001_dev_init(&pm8001_ha->devices[i]);
 	}
 
 #if (PM8001_MAX_CCB_ARRAY == 1)
 	pm8001_ha->ccb_info = pm8001_ha->memoryMap.region[CCB_MEM].virt_ptr;
-	for (i = 0; i < PM8001_MAX_CCB; i++) {
-		pm8001_ha->ccb_info[i].ccb_dma_handle =
-			pm8001_ha->memoryMap.region[CCB_MEM].phys_addr +
-			i * sizeof(struct pm8001_ccb_info);
+	for (i = 0; i < pm8001_ha->ccb_count; i++) {
 		pm8001_ha->ccb_info[i].task = NULL;
 		pm8001_ha->ccb_info[i].ccb_tag = 0xffffffff;
 		pm8001_ha->ccb_info[i].device = NULL;
+		INIT_LIST_HEAD(&pm8001_ha->ccb_info[i].dev_list);
 		++pm8001_ha->tags_num;
 	}
 #else
@@ -340,12 +481,10 @@ static int __devinit pm8001_alloc(struct pm8001_hba_info *pm8001_ha)
 		pm8001_ha->ccb_info[i] =
 			pm8001_ha->memoryMap.region[CCB_MEM + i].virt_ptr;
 		for (j = 0; j < PM8001_CCB_PER_ARRAY; j++) {
-			pm8001_ha->ccb_info[i][j].ccb_dma_handle =
-			pm8001_ha->memoryMap.region[CCB_MEM + i].phys_addr +
-			j * sizeof(struct pm8001_ccb_info);
 			pm8001_ha->ccb_info[i][j].task = NULL;
 			pm8001_ha->ccb_info[i][j].ccb_tag = 0xffffffff;
 			pm8001_ha->ccb_info[i][j].device = NULL;
+			INIT_LIST_HEAD(&pm8001_ha->ccb_info[i][j].dev_list);
 			++pm8001_ha->tags_num;
 		}
 	}
@@ -353,6 +492,8 @@ static int __devinit pm8001_alloc(struct pm8001_hba_info *pm8001_ha)
 	pm8001_ha->flags = PM8001F_INIT_TIME;
 	/* Initialize tags */
 	pm8001_tag_init(pm8001_ha);
+	if (pm8001_ha->stall_ms)
+		pm8001_stall_start(pm8001_ha);
 	return 0;
 err_out:
 	return 1;
@@ -419,7 +560,7 @@ pm8001_pci_alloc(struct pci_dev *pdev, u32 chip_id, struct Scsi_Host *shost)
 {
 	struct pm8001_hba_info *pm8001_ha;
 	struct sas_ha_struct *sha = SHOST_TO_SAS_HA(shost);
-
+	int i;
 
 	pm8001_ha = sha->lldd_ha;
 	if (!pm8001_ha)
@@ -435,11 +576,27 @@ pm8001_pci_alloc(struct pci_dev *pdev, u32 chip_id, struct Scsi_Host *shost)
 	pm8001_ha->id = pm8001_id++;
 	pm8001_ha->logging_level = pm8001_logging_level;
 	pm8001_ha->logging_option = pm8001_logging_option;
+	pm8001_ha->db_batch = pm8001_doorbell_batch;
+	pm8001_ha->poll_budget = max(pm8001_poll_budget, 1);
+	pm8001_ha->coal_adaptive = !!pm8001_coalesce;
+	pm8001_ha->spin_usecs = clamp_t(int, pm8001_spin_usecs, 0,
+		PM8001_SPIN_USECS_MAX);
+	pm8001_ha->steer_completions = !!pm8001_steer_completions;
+	pm8001_ha->orej_backoff_enable = !!pm8001_orej_backoff;
+	pm8001_ha->stall_ms = max(pm8001_stall_timeout, 0);
+	pm8001_ha->coal_count = clamp_t(int, pm8001_coalesce_count, 0,
+		PM8001_COAL_COUNT_MAX);
+	pm8001_ha->coal_delay = clamp_t(int, pm8001_coalesce_delay, 0,
+		PM8001_COAL_DELAY_MAX);
 	sprintf(pm8001_ha->name, "%s%d", DRV_NAME, pm8001_ha->id);
+	for (i = 0; i < PM8001_MAX_MSIX_VEC; i++) {
+		pm8001_ha->irq_vector[i].drv_inst = pm8001_ha;
+		pm8001_ha->irq_vector[i].irq_id = i;
 #ifdef PM8001_USE_TASKLET
-	tasklet_init(&pm8001_ha->tasklet, pm8001_tasklet,
-		(unsigned long)pm8001_ha);
+		tasklet_init(&pm8001_ha->tasklet[i], pm8001_tasklet,
+			(unsigned long)&pm8001_ha->irq_vector[i]);
 #endif
+	}
 	pm8001_ioremap(pm8001_ha);
 	if (!pm8001_alloc(pm8001_ha))
 		return pm8001_ha;
@@ -518,7 +675,7 @@ static int __devinit pm8001_prep_sas_ha_init(struct Scsi_Host * shost,
 	shost->max_channel = 0;
 	shost->unique_id = pm8001_id;
 	shost->max_cmd_len = 16;
-	shost->can_queue = PM8001_CAN_QUEUE;
+	/* can_queue is set once the firmware reports max_out_io */
 	shost->cmd_per_lun = 32;
 	return 0;
 exit_free1:
@@ -553,10 +710,42 @@ static void  __devinit pm8001_post_sas_ha_init(struct Scsi_Host *shost,
 	sha->sas_addr = &pm8001_ha->sas_addr[0][0];
 	sha->num_phys = chip_info->n_phy;
 	sha->lldd_max_execute_num = 1;
-	sha->lldd_queue_size = PM8001_CAN_QUEUE;
+	sha->lldd_queue_size = pm8001_ha->can_queue;
 	sha->core.shost = shost;
 }
 
+/**
+ * pm8001_set_can_queue - size the tag space from the firmware's limit.
+ * @pm8001_ha: our hba structure, with the main config table read.
+ *
+ * max_out_io can trim the tags below the ccbs allocated; what is left,
+ * less PM8001_RESERVED_CCB for internal commands, goes to the midlayer.
+ */
+static void __devinit pm8001_set_can_queue(struct pm8001_hba_info *pm8001_ha)
+{
+	u32 max_out_io = pm8001_ha->main_cfg_tbl.max_out_io;
+
+	if (max_out_io && (max_out_io < pm8001_ha->tags_num)) {
+		pm8001_ha->tags_num = max_out_io;
+		pm8001_tag_init(pm8001_ha);
+	}
+	if (pm8001_ha->tags_num > 2 * PM8001_RESERVED_CCB)
+		pm8001_ha->can_queue =
+			pm8001_ha->tags_num - PM8001_RESERVED_CCB;
+	else
+		pm8001_ha->can_queue = pm8001_ha->tags_num / 2;
+	pm8001_ha->shost->can_queue = pm8001_ha->can_queue;
+	/* one deferred event per command in flight is the worst case seen */
+	if (pm8001_work_pool_init(pm8001_ha, pm8001_ha->can_queue))
+		PM8001_FAIL_DBG(pm8001_ha,
+			pm8001_printk("no event pool, allocating per event\n"));
+	PM8001_INIT_DBG(pm8001_ha,
+		pm8001_printk("ccbs %u tags %d max_out_io %u can_queue %u"
+			" queue depth %u\n", pm8001_ha->ccb_count,
+			pm8001_ha->tags_num, max_out_io, pm8001_ha->can_queue,
+			pm8001_ha->mpi_queue_depth));
+}
+
 /**
  * pm8001_init_sas_add - initialize sas address
  * @chip_info: our ha struct.
@@ -684,9 +873,68 @@ static void pm8001_init_sas_add(struct pm8001_hba_info *pm8001_ha)
 #endif
 }
 
+/**
+ * pm8001_map_cpus - bind each cpu to the outbound queue answering it
+ * @pm8001_ha: our hba structure.
+ *
+ * The i-th online cpu is answered on queue i, modulo the queue count, and
+ * is the affinity hint for that queue's vector.  Cpus that come online
+ * later go by their number.
+ */
+static void pm8001_map_cpus(struct pm8001_hba_info *pm8001_ha)
+{
+	u32 i = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		*per_cpu_ptr(pm8001_ha->cpu_oq, cpu) =
+			cpu % pm8001_ha->outbnd_q_num;
+	for_each_online_cpu(cpu)
+		*per_cpu_ptr(pm8001_ha->cpu_oq, cpu) =
+			i++ % pm8001_ha->outbnd_q_num;
+}
+
+/**
+ * pm8001_enable_msix - enable MSI-X and settle the outbound queue count
+ * @pm8001_ha: our hba structure.
+ *
+ * Runs before chip_init writes the outbound queue table, so that every
+ * queue the table describes has a vector.  When the system has fewer
+ * vectors to give, retry with the count pci_enable_msix offers and use
+ * that many queues; without MSI-X, one queue on INT-X.
+ */
+static void pm8001_enable_msix(struct pm8001_hba_info *pm8001_ha)
+{
+	/* never more queues than pm8001_alloc sized the rings for */
+	int n = pm8001_ha->memoryMap.region[PI].num_elements;
+	int rc = -ENODEV;
+#ifdef PM8001_USE_MSIX
+	int i;
+
+	if (pci_find_capability(pm8001_ha->pdev, PCI_CAP_ID_MSIX)) {
+		for (i = 0; i < n; i++)
+			pm8001_ha->msix_entries[i].entry = i;
+		while ((rc = pci_enable_msix(pm8001_ha->pdev,
+			pm8001_ha->msix_entries, n)) > 0) {
+			PM8001_INIT_DBG(pm8001_ha,
+				pm8001_printk("pci_enable_msix(%d) offers %d\n",
+				n, rc));
+			n = rc;
+		}
+		if (rc)
+			PM8001_FAIL_DBG(pm8001_ha, pm8001_printk(
+				"pci_enable_msix(%d) failed rc=%d\n", n, rc));
+	}
+#endif
+	if (rc)
+		n = 1;
+	pm8001_ha->outbnd_q_num = n;
+	pm8001_map_cpus(pm8001_ha);
+}
+
 #ifdef PM8001_USE_MSIX
 /**
- * pm8001_setup_msix - enable MSI-X interrupt
+ * pm8001_setup_msix - request the MSI-X vectors pm8001_enable_msix got
  * @chip_info: our ha struct.
  * @irq_handler: irq_handler
  */
@@ -694,33 +942,36 @@ static u32 pm8001_setup_msix(struct pm8001_hba_info *pm8001_ha,
 	irq_handler_t irq_handler)
 {
 	u32 i = 0, j = 0;
-	u32 number_of_intr = 1;
+	/* the outbound queue table already names a vector per queue */
+	u32 number_of_intr = pm8001_ha->outbnd_q_num;
 	int flag = 0;
-	u32 max_entry;
-	int rc;
-	max_entry = sizeof(pm8001_ha->msix_entries) /
-		sizeof(pm8001_ha->msix_entries[0]);
+	int rc, cpu;
+
 	flag |= IRQF_DISABLED;
-	for (i = 0; i < max_entry ; i++)
-		pm8001_ha->msix_entries[i].entry = i;
-	rc = pci_enable_msix(pm8001_ha->pdev, pm8001_ha->msix_entries,
-		number_of_intr);
-	pm8001_ha->number_of_intr = number_of_intr;
-	if (!rc) {
-		for (i = 0; i < number_of_intr; i++) {
-			if (request_irq(pm8001_ha->msix_entries[i].vector,
-				irq_handler, flag, DRV_NAME,
-				SHOST_TO_SAS_HA(pm8001_ha->shost))) {
-				for (j = 0; j < i; j++)
-					free_irq(
-					pm8001_ha->msix_entries[j].vector,
-					SHOST_TO_SAS_HA(pm8001_ha->shost));
-				pci_disable_msix(pm8001_ha->pdev);
-				break;
-			}
+	pm8001_ha->number_of_intr = 0;
+	cpu = cpumask_first(cpu_online_mask);
+	for (i = 0; i < number_of_intr; i++) {
+		rc = request_irq(pm8001_ha->msix_entries[i].vector,
+			irq_handler, flag, DRV_NAME,
+			&pm8001_ha->irq_vector[i]);
+		if (rc) {
+			for (j = 0; j < i; j++)
+				free_irq(pm8001_ha->msix_entries[j].vector,
+					&pm8001_ha->irq_vector[j]);
+			pci_disable_msix(pm8001_ha->pdev);
+			return rc;
 		}
+#ifdef PMCS_HAVE_AFFINITY_HINT
+		/* the i-th online cpu is answered here, see pm8001_map_cpus */
+		if (cpu < nr_cpu_ids) {
+			irq_set_affinity_hint(pm8001_ha->msix_entries[i].vector,
+				cpumask_of(cpu));
+			cpu = cpumask_next(cpu, cpu_online_mask);
+		}
+#endif
 	}
-	return rc;
+	pm8001_ha->number_of_intr = number_of_intr;
+	return 0;
 }
 #endif
 
@@ -737,7 +988,7 @@ static u32 pm8001_request_irq(struct pm8001_hba_info *pm8001_ha)
 	pdev = pm8001_ha->pdev;
 
 #ifdef PM8001_USE_MSIX
-	if (pci_find_capability(pdev, PCI_CAP_ID_MSIX))
+	if (pdev->msix_enabled)
 		return pm8001_setup_msix(pm8001_ha, irq_handler);
 	else
 		goto intx;
@@ -746,10 +997,41 @@ static u32 pm8001_request_irq(struct pm8001_hba_info *pm8001_ha)
 intx:
 	/* initialize the INT-X interrupt */
 	rc = request_irq(pdev->irq, irq_handler, IRQF_SHARED, DRV_NAME,
-		SHOST_TO_SAS_HA(pm8001_ha->shost));
+		&pm8001_ha->irq_vector[0]);
 	return rc;
 }
 
+/**
+ * pm8001_free_irq - release what pm8001_request_irq registered
+ * @chip_info: our ha struct.
+ */
+static void pm8001_free_irq(struct pm8001_hba_info *pm8001_ha)
+{
+	int i;
+
+#ifdef PM8001_USE_MSIX
+	if (pm8001_ha->number_of_intr) {
+		for (i = 0; i < pm8001_ha->number_of_intr; i++)
+			synchronize_irq(pm8001_ha->msix_entries[i].vector);
+		for (i = 0; i < pm8001_ha->number_of_intr; i++) {
+#ifdef PMCS_HAVE_AFFINITY_HINT
+			irq_set_affinity_hint(
+				pm8001_ha->msix_entries[i].vector, NULL);
+#endif
+			free_irq(pm8001_ha->msix_entries[i].vector,
+				&pm8001_ha->irq_vector[i]);
+		}
+		pci_disable_msix(pm8001_ha->pdev);
+		pm8001_ha->number_of_intr = 0;
+	} else
+#endif
+		free_irq(pm8001_ha->irq, &pm8001_ha->irq_vector[0]);
+#ifdef PM8001_USE_TASKLET
+	for (i = 0; i < PM8001_MAX_MSIX_VEC; i++)
+		tasklet_kill(&pm8001_ha->tasklet[i]);
+#endif
+}
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 19)
 #include <linux/kthread.h>
 static int
@@ -872,9 +1154,11 @@ static int __devinit pm8001_pci_probe(struct pci_dev *pdev,
 			SPC_SOFT_RESET_SIGNATURE);
 		pm8001_ha->rst_signature = SPC_SOFT_RESET_SIGNATURE;
 	}
+	pm8001_enable_msix(pm8001_ha);
 	rc = PM8001_CHIP_DISP->chip_init(pm8001_ha);
 	if (rc)
 		goto err_out_ha_free;
+	pm8001_set_can_queue(pm8001_ha);
 
 	rc = scsi_add_host(shost, &pdev->dev);
 	if (rc)
@@ -904,6 +1188,7 @@ static int __devinit pm8001_pci_probe(struct pci_dev *pdev,
 err_out_shost:
 	scsi_remove_host(pm8001_ha->shost);
 err_out_ha_free:
+	pci_disable_msix(pdev);
 	pm8001_free(pm8001_ha);
     if ((SHOST_TO_SAS_HA(shost))->sas_phy != NULL)
        PMFREE((SHOST_TO_SAS_HA(shost))->sas_phy, chip->n_phy * sizeof(void *));
@@ -926,7 +1211,6 @@ static void __devexit pm8001_pci_remove(struct pci_dev *pdev)
 {
 	struct sas_ha_struct *sha = pci_get_drvdata(pdev);
 	struct pm8001_hba_info *pm8001_ha;
-	int i;
 	pm8001_ha = sha->lldd_ha;
 	pm8001_debugfs_terminate(pm8001_ha);
 	pci_set_drvdata(pdev, NULL);
@@ -937,18 +1221,7 @@ static void __devexit pm8001_pci_remove(struct pci_dev *pdev)
 	PM8001_CHIP_DISP->interrupt_disable(pm8001_ha);
 	PM8001_CHIP_DISP->chip_soft_rst(pm8001_ha, pm8001_ha->rst_signature);
 
-#ifdef PM8001_USE_MSIX
-	for (i = 0; i < pm8001_ha->number_of_intr; i++)
-		synchronize_irq(pm8001_ha->msix_entries[i].vector);
-	for (i = 0; i < pm8001_ha->number_of_intr; i++)
-		free_irq(pm8001_ha->msix_entries[i].vector, sha);
-	pci_disable_msix(pdev);
-#else
-	free_irq(pm8001_ha->irq, sha);
-#endif
-#ifdef PM8001_USE_TASKLET
-	tasklet_kill(&pm8001_ha->tasklet);
-#endif
+	pm8001_free_irq(pm8001_ha);
 	pm8001_free(pm8001_ha);
 	PMFREE(sha->sas_phy, sha->num_phys *  sizeof(void *));
 	PMFREE(sha->sas_port, sha->num_phys * sizeof(void *));
@@ -968,7 +1241,7 @@ static int pm8001_pci_suspend(struct pci_dev *pdev, pm_message_t state)
 {
 	struct sas_ha_struct *sha = pci_get_drvdata(pdev);
 	struct pm8001_hba_info *pm8001_ha;
-	int i , pos;
+	int pos;
 	u32 device_state;
 	pm8001_ha = sha->lldd_ha;
 	pm8001_debugfs_terminate(pm8001_ha);
@@ -981,18 +1254,7 @@ static int pm8001_pci_suspend(struct pci_dev *pdev, pm_message_t state)
 	}
 	PM8001_CHIP_DISP->interrupt_disable(pm8001_ha);
 	PM8001_CHIP_DISP->chip_soft_rst(pm8001_ha, pm8001_ha->rst_signature);
-#ifdef PM8001_USE_MSIX
-	for (i = 0; i < pm8001_ha->number_of_intr; i++)
-		synchronize_irq(pm8001_ha->msix_entries[i].vector);
-	for (i = 0; i < pm8001_ha->number_of_intr; i++)
-		free_irq(pm8001_ha->msix_entries[i].vector, sha);
-	pci_disable_msix(pdev);
-#else
-	free_irq(pm8001_ha->irq, sha);
-#endif
-#ifdef PM8001_USE_TASKLET
-	tasklet_kill(&pm8001_ha->tasklet);
-#endif
+	pm8001_free_irq(pm8001_ha);
 	device_state = pci_choose_state(pdev, state);
 	pm8001_printk("pdev=0x%p, slot=%s, entering "
 		      "operating state [D%d]\n", pdev,
@@ -1013,7 +1275,7 @@ static int pm8001_pci_resume(struct pci_dev *pdev)
 {
 	struct sas_ha_struct *sha = pci_get_drvdata(pdev);
 	struct pm8001_hba_info *pm8001_ha;
-	int rc;
+	int i, rc;
 	u32 device_state;
 	pm8001_ha = sha->lldd_ha;
 	device_state = pdev->current_state;
@@ -1037,6 +1299,7 @@ static int pm8001_pci_resume(struct pci_dev *pdev)
 		goto err_out_disable;
 
 	PM8001_CHIP_DISP->chip_soft_rst(pm8001_ha, pm8001_ha->rst_signature);
+	pm8001_enable_msix(pm8001_ha);
 	rc = PM8001_CHIP_DISP->chip_init(pm8001_ha);
 	if (rc)
 		goto err_out_disable;
@@ -1045,8 +1308,9 @@ static int pm8001_pci_resume(struct pci_dev *pdev)
 	if (rc)
 		goto err_out_disable;
 	#ifdef PM8001_USE_TASKLET
-	tasklet_init(&pm8001_ha->tasklet, pm8001_tasklet,
-		    (unsigned long)pm8001_ha);
+	for (i = 0; i < PM8001_MAX_MSIX_VEC; i++)
+		tasklet_init(&pm8001_ha->tasklet[i], pm8001_tasklet,
+			(unsigned long)&pm8001_ha->irq_vector[i]);
 	#endif
 	PM8001_CHIP_DISP->interrupt_enable(pm8001_ha);
 	scsi_unblock_requests(pm8001_ha->shost);
@@ -1055,6 +1319,7 @@ static int pm8001_pci_resume(struct pci_dev *pdev)
 
 err_out_disable:
 	scsi_remove_host(pm8001_ha->shost);
+	pci_disable_msix(pdev);
 	pci_disable_device(pdev);
 err_out_enable:
 	return rc;
@@ -1137,6 +1402,47 @@ module_param_named(scsi_ehandler, pm8001_scsi_ehandler, int, S_IRUGO);
 MODULE_PARM_DESC(scsi_ehandler, "Enable scsi error handler");
 module_param_named(disable, pm8001_disable, int, S_IRUGO|S_IWUSR);
 MODULE_PARM_DESC(disable, "Disable Driver");
+module_param_named(doorbell_batch, pm8001_doorbell_batch, int, S_IRUGO);
+MODULE_PARM_DESC(doorbell_batch,
+	"Max IOMBs posted per inbound doorbell write (<= 1 rings every IOMB)");
+module_param_named(max_ccb, pm8001_max_ccb, int, S_IRUGO);
+MODULE_PARM_DESC(max_ccb, "Command blocks to allocate ("
+	__stringify(PM8001_MIN_CCB) "-" __stringify(PM8001_MAX_CCB)
+	"), trimmed to the firmware's max_out_io");
+module_param_named(queue_depth, pm8001_queue_depth, int, S_IRUGO);
+MODULE_PARM_DESC(queue_depth, "Entries per MPI inbound/outbound queue ("
+	__stringify(PM8001_MPI_QUEUE_MIN) "-" __stringify(PM8001_MPI_QUEUE_MAX)
+	", rounded up to a power of two, halved until 2MB holds all queues)");
+module_param_named(poll_budget, pm8001_poll_budget, int, S_IRUGO);
+MODULE_PARM_DESC(poll_budget,
+	"Max completions handled per outbound queue poll before yielding");
+module_param_named(coalesce, pm8001_coalesce, int, S_IRUGO);
+MODULE_PARM_DESC(coalesce,
+	"Outbound interrupt coalescing: 0 fixed, 1 adaptive to the load");
+module_param_named(coalesce_count, pm8001_coalesce_count, int, S_IRUGO);
+MODULE_PARM_DESC(coalesce_count,
+	"Fixed mode: interrupt once this many completions are queued (0-255)");
+module_param_named(coalesce_delay, pm8001_coalesce_delay, int, S_IRUGO);
+MODULE_PARM_DESC(coalesce_delay,
+	"Fixed mode: or once the oldest has waited this many usec (0-65535)");
+module_param_named(spin_usecs, pm8001_spin_usecs, int, S_IRUGO);
+MODULE_PARM_DESC(spin_usecs,
+	"Hybrid polling: usec an SSP submitter spins for its completion"
+	" before leaving it to the interrupt (0 disables, at most "
+	__stringify(PM8001_SPIN_USECS_MAX) ")");
+module_param_named(steer_completions, pm8001_steer_completions, int,
+	S_IRUGO);
+MODULE_PARM_DESC(steer_completions,
+	"Run task_done on the cpu that submitted the I/O (IPI when it differs;"
+	" off by default, the block layer's rq_affinity already does this)");
+module_param_named(orej_backoff, pm8001_orej_backoff, int, S_IRUGO);
+MODULE_PARM_DESC(orej_backoff,
+	"Hold back repeated open reject retries to a device with a jittered"
+	" exponential delay (0 retries at once)");
+module_param_named(stall_timeout, pm8001_stall_timeout, int, S_IRUGO);
+MODULE_PARM_DESC(stall_timeout,
+	"msec before an outstanding command is timed out early and handed"
+	" to the SCSI error handler (default 0, off)");
 module_init(pm8001_init);
 module_exit(pm8001_exit);
 
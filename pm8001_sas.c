@@ -65,14 +65,27 @@ static int pm8001_find_tag(struct sas_task *task, u32 *tag)
   * pm8001_tag_clear - clear the tags bitmap
   * @pm8001_ha: our hba struct
   * @tag: the found tag associated with the task
+  *
+  * Safe without pm8001_ha->lock.  The freeing cpu's next allocation starts
+  * at this slot, which is likely still warm in its cache.
   */
 static void pm8001_tag_clear(struct pm8001_hba_info *pm8001_ha, u32 tag)
 {
 	void *bitmap = pm8001_ha->tags;
+	struct pm8001_ccb_info *ccb = get_ccb_array(pm8001_ha, tag);
+
+	pm8001_ccb_unlink(ccb);
+	ccb->track = 0;
+	/* hand back any sg table the I/O borrowed */
+	if (ccb->sgl) {
+		dma_pool_free(pm8001_ha->sgl_pool[ccb->sgl_class], ccb->sgl,
+			ccb->sgl_dma);
+		ccb->sgl = NULL;
+	}
 	tag = TAG_IDX_MASK(tag);
-	WARN_ON(test_bit(tag, bitmap) == 0);
-	clear_bit(tag, bitmap);
-	pm8001_ha->tags_alloc--;
+	WARN_ON(test_and_clear_bit(tag, bitmap) == 0);
+	atomic_dec(&pm8001_ha->tags_alloc);
+	*per_cpu_ptr(pm8001_ha->tags_hint, raw_smp_processor_id()) = tag;
 }
 
 inline void pm8001_tag_free(struct pm8001_hba_info *pm8001_ha, u32 tag)
@@ -80,32 +93,165 @@ inline void pm8001_tag_free(struct pm8001_hba_info *pm8001_ha, u32 tag)
 	pm8001_tag_clear(pm8001_ha, tag);
 }
 
-static void pm8001_tag_set(struct pm8001_hba_info *pm8001_ha, u32 tag)
+/**
+  * pm8001_tag_find - claim a clear bit at or after @start, wrapping once.
+  * @bitmap: the tags bitmap
+  * @num: number of bits
+  * @start: the cpu's hint
+  *
+  * Returns the claimed index, or -1 when every bit is set.
+  */
+static int pm8001_tag_find(unsigned long *bitmap, unsigned int num,
+	unsigned int start)
 {
-	void *bitmap = pm8001_ha->tags;
-	tag = TAG_IDX_MASK(tag);
-	WARN_ON(test_bit(tag, bitmap));
-	set_bit(tag, bitmap);
-	pm8001_ha->tags_alloc++;
+	unsigned int index = start, end = num;
+
+	for (;;) {
+		index = find_next_zero_bit(bitmap, end, index);
+		if (index >= end) {
+			if (end != num || !start)
+				return -1;
+			/* second pass over what the first one skipped */
+			end = start;
+			index = 0;
+			continue;
+		}
+		if (!test_and_set_bit(index, bitmap))
+			return index;
+		/* lost the race for this bit to another cpu */
+		index++;
+	}
 }
 
 /**
   * pm8001_tag_alloc - allocate a empty tag for task used.
   * @pm8001_ha: our hba struct
   * @tag_out: the found empty tag .
+  *
+  * Lock free: bits are claimed with test_and_set_bit and each cpu scans
+  * from its own hint, so cpus mostly work different words of the bitmap.
+  * The upper half of the tag is a per-ccb generation number that lets
+  * completions for an earlier use of the slot be recognised as stale.
   */
 inline int pm8001_tag_alloc(struct pm8001_hba_info *pm8001_ha, u32 *tag_out)
 {
-	unsigned int index, tag;
-	void *bitmap = pm8001_ha->tags;
-
-	index = find_first_zero_bit(bitmap, pm8001_ha->tags_num);
-	tag = index;
-	if (tag >= pm8001_ha->tags_num)
+	struct pm8001_ccb_info *ccb;
+	unsigned int *hint;
+	int index;
+
+	hint = per_cpu_ptr(pm8001_ha->tags_hint, get_cpu());
+	index = pm8001_tag_find(pm8001_ha->tags, pm8001_ha->tags_num,
+		(*hint < pm8001_ha->tags_num) ? *hint : 0);
+	if (index < 0) {
+		put_cpu();
 		return -SAS_QUEUE_FULL;
-	tag = TAG_MAKE(pm8001_ha, tag);
-	pm8001_tag_set(pm8001_ha, tag);
-	*tag_out = tag;
+	}
+	*hint = index + 1;
+	put_cpu();
+	atomic_inc(&pm8001_ha->tags_alloc);
+	/* the slot is ours now, nobody else touches its generation */
+	ccb = get_ccb_array(pm8001_ha, index);
+	*tag_out = TAG_MAKE(++ccb->tag_serno, index);
+	return 0;
+}
+
+/**
+  * pm8001_sgl_pool_init - create the size-classed external sg table pools.
+  * @pm8001_ha: our hba struct
+  *
+  * A ccb only borrows a table when its I/O has more than one segment, so
+  * the ccbs themselves no longer carry PM8001_MAX_DMA_SG PRDs each.
+  */
+int pm8001_sgl_pool_init(struct pm8001_hba_info *pm8001_ha)
+{
+	static const u32 size[PM8001_SGL_CLASSES] = PM8001_SGL_CLASS_SIZES;
+	char name[32];
+	int i;
+
+	for (i = 0; i < PM8001_SGL_CLASSES; i++) {
+		pm8001_ha->sgl_size[i] = min_t(u32, size[i], PM8001_MAX_DMA_SG);
+		snprintf(name, sizeof(name), "%s_sgl%u", pm8001_ha->name,
+			pm8001_ha->sgl_size[i]);
+		pm8001_ha->sgl_pool[i] = dma_pool_create(name, pm8001_ha->dev,
+			pm8001_ha->sgl_size[i] * sizeof(struct pm8001_prd),
+			16, 0);
+		if (!pm8001_ha->sgl_pool[i])
+			return -ENOMEM;
+	}
+	return 0;
+}
+
+void pm8001_sgl_pool_free(struct pm8001_hba_info *pm8001_ha)
+{
+	int i;
+
+	for (i = 0; i < PM8001_SGL_CLASSES; i++) {
+		if (pm8001_ha->sgl_pool[i])
+			dma_pool_destroy(pm8001_ha->sgl_pool[i]);
+		pm8001_ha->sgl_pool[i] = NULL;
+	}
+}
+
+/**
+  * pm8001_work_pool_init - preallocate the deferred event work items.
+  * @pm8001_ha: our hba struct
+  * @num: how many
+  *
+  * pm8001_handle_event runs in the completion path; taking its work items
+  * from here keeps a link flap from turning into atomic allocations.
+  */
+int pm8001_work_pool_init(struct pm8001_hba_info *pm8001_ha, u32 num)
+{
+	pm8001_ha->work_map = PMALLOC(BITS_TO_LONGS(num) * sizeof(long),
+		GFP_KERNEL);
+	if (!pm8001_ha->work_map)
+		return -ENOMEM;
+	pm8001_ha->work_pool = PMALLOC(num * sizeof(struct pm8001_work),
+		GFP_KERNEL);
+	if (!pm8001_ha->work_pool) {
+		PMFREE(pm8001_ha->work_map, BITS_TO_LONGS(num) * sizeof(long));
+		pm8001_ha->work_map = NULL;
+		return -ENOMEM;
+	}
+	pm8001_ha->work_num = num;
+	return 0;
+}
+
+void pm8001_work_pool_free(struct pm8001_hba_info *pm8001_ha)
+{
+	u32 num = pm8001_ha->work_num;
+
+	if (!num)
+		return;
+	pm8001_ha->work_num = 0;
+	PMFREE(pm8001_ha->work_pool, num * sizeof(struct pm8001_work));
+	PMFREE(pm8001_ha->work_map, BITS_TO_LONGS(num) * sizeof(long));
+	pm8001_ha->work_pool = NULL;
+	pm8001_ha->work_map = NULL;
+}
+
+/**
+  * pm8001_sgl_get - borrow an external sg table big enough for @n_elem.
+  * @pm8001_ha: our hba struct
+  * @ccb: the ccb, which keeps it until its tag is freed
+  * @n_elem: mapped segments
+  */
+int pm8001_sgl_get(struct pm8001_hba_info *pm8001_ha,
+	struct pm8001_ccb_info *ccb, u32 n_elem)
+{
+	u8 class;
+
+	for (class = 0; class < PM8001_SGL_CLASSES - 1; class++)
+		if (n_elem <= pm8001_ha->sgl_size[class])
+			break;
+	ccb->sgl = dma_pool_alloc(pm8001_ha->sgl_pool[class], GFP_ATOMIC,
+		&ccb->sgl_dma);
+	if (unlikely(!ccb->sgl)) {
+		PM8001_FAIL_DBG(pm8001_ha,
+			pm8001_printk("no sg table for %u segments\n", n_elem));
+		return -ENOMEM;
+	}
+	ccb->sgl_class = class;
 	return 0;
 }
 
@@ -116,6 +262,53 @@ void pm8001_tag_init(struct pm8001_hba_info *pm8001_ha)
 	for (i = 0; i < pm8001_ha->tags_num; ++i) {
   		clear_bit(i, bitmap);
 	}
+	atomic_set(&pm8001_ha->tags_alloc, 0);
+	/* start each cpu in its own stretch of the bitmap */
+	for_each_possible_cpu(i)
+		*per_cpu_ptr(pm8001_ha->tags_hint, i) =
+			(i * pm8001_ha->tags_num) / nr_cpu_ids;
+}
+
+/**
+  * pm8001_lock_all - quiesce the hba for a slow path.
+  * @pm8001_ha: our hba struct
+  * @flags: saved interrupt state
+  *
+  * The I/O paths only take the lock of the queue they work on: iq_lock to
+  * post, oq_lock to drain.  Error handling that walks or frees ccbs behind
+  * the back of a completion or a submitter takes every outbound queue lock,
+  * the host lock, then every inbound queue lock, so that no completion and
+  * no post can be in flight.  A ccb only goes on its device's list inside
+  * the iq_lock section that posts it, so anything found there is complete.
+  * Nothing may post while holding this.  Lock order is oq_lock[0] ..
+  * oq_lock[n-1], lock, iq_lock[0] .. iq_lock[n-1], task_state_lock.  A
+  * device's ccb_lock nests inside all of these, and inside the request
+  * queue lock for the stall scan's early timeout.
+  */
+void pm8001_lock_all(struct pm8001_hba_info *pm8001_ha, unsigned long *flags)
+{
+	u32 i;
+
+	local_irq_save(*flags);
+	for (i = 0; i < pm8001_ha->outbnd_q_num; i++)
+		pm8001_spin_lock_counted(&pm8001_ha->outbnd_q_tbl[i].oq_lock,
+			&pm8001_ha->outbnd_q_tbl[i].oq_contended);
+	pm8001_spin_lock_counted(&pm8001_ha->lock, &pm8001_ha->lock_contended);
+	for (i = 0; i < pm8001_ha->inbnd_q_num; i++)
+		pm8001_spin_lock_counted(&pm8001_ha->inbnd_q_tbl[i].iq_lock,
+			&pm8001_ha->inbnd_q_tbl[i].iq_contended);
+}
+
+void pm8001_unlock_all(struct pm8001_hba_info *pm8001_ha, unsigned long flags)
+{
+	u32 i;
+
+	for (i = pm8001_ha->inbnd_q_num; i-- > 0; )
+		spin_unlock(&pm8001_ha->inbnd_q_tbl[i].iq_lock);
+	spin_unlock(&pm8001_ha->lock);
+	for (i = pm8001_ha->outbnd_q_num; i-- > 0; )
+		spin_unlock(&pm8001_ha->outbnd_q_tbl[i].oq_lock);
+	local_irq_restore(flags);
 }
 
  /**
@@ -331,9 +524,9 @@ u32 pm8001_get_ncq_tag(struct sas_task *task, u32 *tag)
   * @ccb: the ccb which attached to sata task
   */
 static int pm8001_task_prep_ata(struct pm8001_hba_info *pm8001_ha,
-	struct pm8001_ccb_info *ccb)
+	struct pm8001_ccb_info *ccb, struct pm8001_iq_plug *plug)
 {
-	return PM8001_CHIP_DISP->sata_req(pm8001_ha, ccb);
+	return PM8001_CHIP_DISP->sata_req(pm8001_ha, ccb, plug);
 }
 
 /**
@@ -354,9 +547,9 @@ static int pm8001_task_prep_ssp_tm(struct pm8001_hba_info *pm8001_ha,
   * @ccb: the ccb which attached to ssp task
   */
 static int pm8001_task_prep_ssp(struct pm8001_hba_info *pm8001_ha,
-	struct pm8001_ccb_info *ccb)
+	struct pm8001_ccb_info *ccb, struct pm8001_iq_plug *plug)
 {
-	return PM8001_CHIP_DISP->ssp_io_req(pm8001_ha, ccb);
+	return PM8001_CHIP_DISP->ssp_io_req(pm8001_ha, ccb, plug);
 }
 int pm8001_slave_configure(struct scsi_device *sdev)
 {
@@ -409,9 +602,10 @@ static int pm8001_task_exec(struct sas_task *task, const int num,
 	struct pm8001_hba_info *pm8001_ha;
 	struct pm8001_device *pm8001_dev;
 	struct pm8001_port *port = NULL;
-	struct sas_task *t = task;
-	struct pm8001_ccb_info *ccb;
-	u32 tag = 0xdeadbeef, rc, n_elem = 0;
+	struct sas_task *t = task, *next;
+	struct pm8001_ccb_info *ccb, *spin_ccb = NULL;
+	struct pm8001_iq_plug plug;
+	u32 tag = 0xdeadbeef, rc, n_elem = 0, spin_tag = 0;
 	u32 n = num;
 	unsigned long flags = 0, flags_libsas = 0;
 
@@ -425,8 +619,16 @@ static int pm8001_task_exec(struct sas_task *task, const int num,
 	}
 	pm8001_ha = pm8001_find_ha_by_dev(task->dev);
 	PM8001_IO_DBG(pm8001_ha, pm8001_printk("pm8001_task_exec device\n"));
-	spin_lock_irqsave(&pm8001_ha->lock, flags);
+	/*
+	 * No host lock here: tags are lock free, device accounting is atomic
+	 * and the inbound queue has its own lock.
+	 * post the whole list, then ring the doorbell once
+	 */
+	PM8001_CHIP_DISP->iq_plug(pm8001_ha, &plug);
 	do {
+		/* once posted, t can complete and be freed under us */
+		next = (n > 1) ? list_entry(t->list.next, struct sas_task, list)
+			: NULL;
 		dev = t->dev;
 		pm8001_dev = dev->lldd_dev;
 		port = &pm8001_ha->port[sas_find_local_port_id(dev)];
@@ -436,28 +638,19 @@ static int pm8001_task_exec(struct sas_task *task, const int num,
 				ts->resp = SAS_TASK_UNDELIVERED;
 				ts->stat = SAS_PHY_DOWN;
 
-				spin_unlock_irqrestore(&pm8001_ha->lock, flags);
 				spin_unlock_irqrestore(dev->sata_dev.ap->lock,
 						flags_libsas);
 				t->task_done(t);
 				spin_lock_irqsave(dev->sata_dev.ap->lock,
 					flags_libsas);
-				spin_lock_irqsave(&pm8001_ha->lock, flags);
-				if (n > 1)
-					t = list_entry(t->list.next,
-							struct sas_task, list);
+				t = next;
 				continue;
 			} else {
-				struct sas_task *tt = t;
 				struct task_status_struct *ts = &t->task_status;
 				ts->resp = SAS_TASK_UNDELIVERED;
 				ts->stat = SAS_PHY_DOWN;
-				if (n > 1)
-					t = list_entry(t->list.next,
-							struct sas_task, list);
-				spin_unlock_irqrestore(&pm8001_ha->lock, flags);
-				tt->task_done(tt);
-				spin_lock_irqsave(&pm8001_ha->lock, flags);
+				t->task_done(t);
+				t = next;
 				continue;
 			}
 		}
@@ -489,6 +682,18 @@ static int pm8001_task_exec(struct sas_task *task, const int num,
 		ccb->n_elem = n_elem;
 		ccb->ccb_tag = tag;
 		ccb->task = t;
+		/* only the stall scan and the latency histogram read it */
+		if (pm8001_ha->spin_usecs || pm8001_dev->stall_ms)
+			ccb->issued = ktime_get();
+		else
+			ccb->issued = ktime_set(0, 0);
+		ccb->cpu = raw_smp_processor_id();
+		/* published to the slow paths by the post itself */
+		ccb->track = 1;
+		/* the completion may run before the prep routine returns */
+		spin_lock_irqsave(&t->task_state_lock, flags);
+		t->task_state_flags |= SAS_TASK_AT_INITIATOR;
+		spin_unlock_irqrestore(&t->task_state_lock, flags);
 		switch (t->task_proto) {
 		case SAS_PROTOCOL_SMP:
 			rc = pm8001_task_prep_smp(pm8001_ha, ccb);
@@ -497,13 +702,18 @@ static int pm8001_task_exec(struct sas_task *task, const int num,
 			if (is_tmf)
 				rc = pm8001_task_prep_ssp_tm(pm8001_ha,
 					ccb, tmf);
-			else
-				rc = pm8001_task_prep_ssp(pm8001_ha, ccb);
+			else {
+				rc = pm8001_task_prep_ssp(pm8001_ha, ccb,
+					&plug);
+				/* the last one posted is waited on below */
+				spin_ccb = ccb;
+				spin_tag = tag;
+			}
 			break;
 		case SAS_PROTOCOL_SATA:
 		case SAS_PROTOCOL_STP:
 		case SAS_PROTOCOL_SATA | SAS_PROTOCOL_STP:
-			rc = pm8001_task_prep_ata(pm8001_ha, ccb);
+			rc = pm8001_task_prep_ata(pm8001_ha, ccb, &plug);
 			break;
 		default:
 			dev_printk(KERN_ERR, pm8001_ha->dev,
@@ -517,14 +727,12 @@ static int pm8001_task_exec(struct sas_task *task, const int num,
 			PM8001_IO_DBG(pm8001_ha,
 				pm8001_printk("rc is %x\n", rc));
 			BUG_ON(n > 1);
+			spin_lock_irqsave(&t->task_state_lock, flags);
+			t->task_state_flags &= ~SAS_TASK_AT_INITIATOR;
+			spin_unlock_irqrestore(&t->task_state_lock, flags);
 			goto err_out_tag;
 		}
-		/* TODO: select normal or high priority */
-		spin_lock(&t->task_state_lock);
-		t->task_state_flags |= SAS_TASK_AT_INITIATOR;
-		spin_unlock(&t->task_state_lock);
-		if (n > 1)
-			t = list_entry(t->list.next, struct sas_task, list);
+		t = next;
 	} while (--n);
 	rc = 0;
 	goto out_done;
@@ -540,7 +748,10 @@ err_out:
 			dma_unmap_sg(pm8001_ha->dev, t->scatter, n_elem,
 				t->data_dir);
 out_done:
-	spin_unlock_irqrestore(&pm8001_ha->lock, flags);
+	PM8001_CHIP_DISP->iq_unplug(pm8001_ha, &plug);
+	/* hybrid polling: reap the response here rather than wait for the irq */
+	if (!rc && spin_ccb && pm8001_ha->spin_usecs && !irqs_disabled())
+		PM8001_CHIP_DISP->oq_spin(pm8001_ha, spin_ccb, spin_tag);
 	return rc;
 }
 
@@ -607,6 +818,91 @@ void pm8001_ccb_task_free(struct pm8001_hba_info *pm8001_ha,
 	pm8001_ccb_free(pm8001_ha, ccb_idx);
 }
 
+/**
+  * pm8001_ccb_link - put a ccb on its device's in-flight list.
+  * @ccb: the ccb, with device and task already filled in
+  *
+  * Called by the post, under the inbound queue's iq_lock.
+  */
+void pm8001_ccb_link(struct pm8001_ccb_info *ccb)
+{
+	struct pm8001_device *pm8001_dev = ccb->device;
+	unsigned long flags;
+
+	ccb->stalled = 0;
+	spin_lock_irqsave(&pm8001_dev->ccb_lock, flags);
+	list_add_tail(&ccb->dev_list, &pm8001_dev->ccb_list);
+	spin_unlock_irqrestore(&pm8001_dev->ccb_lock, flags);
+}
+
+/**
+  * pm8001_ccb_unlink - take a ccb off its device's in-flight list.
+  * @ccb: the ccb
+  *
+  * Safe to call more than once; every tag free comes through here.
+  */
+void pm8001_ccb_unlink(struct pm8001_ccb_info *ccb)
+{
+	struct pm8001_device *pm8001_dev = ccb->device;
+	unsigned long flags;
+
+	if (!pm8001_dev || list_empty(&ccb->dev_list))
+		return;
+	spin_lock_irqsave(&pm8001_dev->ccb_lock, flags);
+	/* a slow path may have popped it since the unlocked look */
+	if (!list_empty(&ccb->dev_list))
+		list_del_init(&ccb->dev_list);
+	spin_unlock_irqrestore(&pm8001_dev->ccb_lock, flags);
+}
+
+/**
+  * pm8001_task_ccb - the ccb a task is running on, if it still is.
+  * @task: the sas task
+  *
+  * Returns NULL once the ccb has been freed or handed to another task.
+  */
+struct pm8001_ccb_info *pm8001_task_ccb(struct sas_task *task)
+{
+	struct pm8001_ccb_info *ccb = task->lldd_task;
+
+	if (!ccb || (ccb->task != task) || (ccb->ccb_tag == 0xFFFFFFFF))
+		return NULL;
+	return ccb;
+}
+
+/**
+  * pm8001_dev_ccb_pop - unlink the first in-flight ccb of a device.
+  * @pm8001_dev: the device
+  * @task: only match this task, or any task if NULL
+  */
+static struct pm8001_ccb_info *pm8001_dev_ccb_pop(
+	struct pm8001_device *pm8001_dev, struct sas_task *task)
+{
+	struct pm8001_ccb_info *ccb, *found = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&pm8001_dev->ccb_lock, flags);
+	list_for_each_entry(ccb, &pm8001_dev->ccb_list, dev_list) {
+		if (!ccb->task || (task && (ccb->task != task)))
+			continue;
+		list_del_init(&ccb->dev_list);
+		found = ccb;
+		break;
+	}
+	spin_unlock_irqrestore(&pm8001_dev->ccb_lock, flags);
+	return found;
+}
+
+/**
+  * pm8001_dev_init - set up the in-flight ccb list of a device slot.
+  * @pm8001_dev: the device
+  */
+void pm8001_dev_init(struct pm8001_device *pm8001_dev)
+{
+	spin_lock_init(&pm8001_dev->ccb_lock);
+	INIT_LIST_HEAD(&pm8001_dev->ccb_list);
+}
+
  /**
   * pm8001_alloc_dev - find a empty pm8001_device
   * @pm8001_ha: our hba card information
@@ -634,7 +930,19 @@ struct pm8001_device *pm8001_alloc_dev(struct pm8001_hba_info *pm8001_ha)
 static void pm8001_free_dev(struct pm8001_hba_info *pm8001_ha, struct pm8001_device *pm8001_dev)
 {
 	u32 id = pm8001_dev->id;
-	memset(pm8001_dev, 0, sizeof(*pm8001_dev));
+	struct pm8001_ccb_info *ccb, *n;
+
+	/* retries held for it would land on whoever gets the slot next */
+	pm8001_orej_drop(pm8001_ha, pm8001_dev);
+	/*
+	 * orphan anything still in flight; the lock and list head survive,
+	 * as an unlink may be waiting on the lock
+	 */
+	spin_lock(&pm8001_dev->ccb_lock);
+	list_for_each_entry_safe(ccb, n, &pm8001_dev->ccb_list, dev_list)
+		list_del_init(&ccb->dev_list);
+	memset(pm8001_dev, 0, offsetof(struct pm8001_device, ccb_lock));
+	spin_unlock(&pm8001_dev->ccb_lock);
 	pm8001_dev->id = id;
 	pm8001_dev->dev_type = NO_DEVICE;
 	pm8001_dev->device_id = PM8001_MAX_DEVICES;
@@ -673,6 +981,8 @@ static int pm8001_dev_found_notify(struct domain_device *dev)
 	dev->lldd_dev = pm8001_device;
 	pm8001_device->dev_type = dev->dev_type;
 	pm8001_device->dcompletion = &completion;
+	pm8001_device->stall_ms = pm8001_ha->stall_ms;
+	pm8001_device->stuck = 0;
 	if (parent_dev && DEV_IS_EXPANDER(parent_dev->dev_type)) {
 		int phy_id;
 		struct ex_phy *phy;
@@ -818,11 +1128,11 @@ static int pm8001_exec_internal_tmf_task(struct domain_device *dev,
 		wait_for_completion(&task->completion);
 		/*
 		 * We have to be careful here. If the task management timer timed out (pm8001_tmf_timedout),
-		 * we may have an active CCB in play, so we have to get the HBA lock first and then the
+		 * we may have an active CCB in play, so we have to quiesce the HBA (pm8001_lock_all) and then take the
 		 * task state lock to look at things and perhaps break the linkage between the CCB and
 	 	 * this task structure.
 		 */
-		spin_lock_irqsave(&pm8001_ha->lock, flags);
+		pm8001_lock_all(pm8001_ha, &flags);
 		spin_lock(&task->task_state_lock);
 		/* Even TMF timed out, return direct. */
 		if ((task->task_state_flags & SAS_TASK_STATE_ABORTED)) {
@@ -842,13 +1152,13 @@ static int pm8001_exec_internal_tmf_task(struct domain_device *dev,
 					pm8001_ccb_free(pm8001_ha, tag);
 
 				}
-				spin_unlock_irqrestore(&pm8001_ha->lock, flags);
+				pm8001_unlock_all(pm8001_ha, flags);
 				res = TMF_RESP_FUNC_FAILED;
 				goto ex_err;
 			}
 		}
 		spin_unlock(&task->task_state_lock);
-		spin_unlock_irqrestore(&pm8001_ha->lock, flags);
+		pm8001_unlock_all(pm8001_ha, flags);
 
 		/*
 		 * If the sas response shows task complete, we can just can return the status.
@@ -904,11 +1214,14 @@ pm8001_exec_internal_task_abort(struct pm8001_hba_info *pm8001_ha,
 		ccb->device = pm8001_dev;
 		ccb->ccb_tag = ccb_tag;
 		ccb->task = task;
+		ccb->issued = ktime_get();
+		ccb->track = 1;
 
 		res = PM8001_CHIP_DISP->task_abort(pm8001_ha,
 			pm8001_dev, abort_all, task_tag, ccb_tag);
 
 		if (res) {
+			pm8001_ccb_unlink(ccb);
 			del_timer(&task->timer);
 			spin_unlock_irqrestore(&pm8001_ha->lock, flags);
 			PM8001_FAIL_DBG(pm8001_ha,
@@ -921,11 +1234,11 @@ pm8001_exec_internal_task_abort(struct pm8001_hba_info *pm8001_ha,
 		wait_for_completion(&task->completion);
 		/*
 		 * We have to be careful here. If the task management timer timed out (pm8001_tmf_timedout),
-		 * we may have an active CCB in play, so we have to get the HBA lock first and then the
+		 * we may have an active CCB in play, so we have to quiesce the HBA (pm8001_lock_all) and then take the
 		 * task state lock to look at things and perhaps break the linkage between the CCB and
 	 	 * this task structure.
 		 */
-		spin_lock_irqsave(&pm8001_ha->lock, flags);
+		pm8001_lock_all(pm8001_ha, &flags);
 		spin_lock(&task->task_state_lock);
 		/* Even TMF timed out, return direct. */
 		if ((task->task_state_flags & SAS_TASK_STATE_ABORTED)) {
@@ -942,12 +1255,12 @@ pm8001_exec_internal_task_abort(struct pm8001_hba_info *pm8001_ha,
 					ccb->open_retry = 0;
 					pm8001_ccb_free(pm8001_ha, ccb_tag);
 				}
-				spin_unlock_irqrestore(&pm8001_ha->lock, flags);
+				pm8001_unlock_all(pm8001_ha, flags);
 				goto ex_err;
 			}
 		}
 		spin_unlock(&task->task_state_lock);
-		spin_unlock_irqrestore(&pm8001_ha->lock, flags);
+		pm8001_unlock_all(pm8001_ha, flags);
 		/*
 		 * If the sas response shows task complete, we can just can return the status.
 		 */
@@ -979,22 +1292,22 @@ static void pm8001_dev_gone_notify(struct domain_device *dev)
 	struct pm8001_device *pm8001_dev = dev->lldd_dev;
 
 	pm8001_ha = pm8001_find_ha_by_dev(dev);
-	spin_lock_irqsave(&pm8001_ha->lock, flags);
+	pm8001_lock_all(pm8001_ha, &flags);
 	if (pm8001_dev) {
 		u32 device_id = pm8001_dev->device_id;
 
 		PM8001_DISC_DBG(pm8001_ha,
 			pm8001_printk("found dev[%d:%x] 0x%016llx is gone.\n", pm8001_dev->device_id, pm8001_dev->dev_type, SAS_ADDR(dev->sas_addr)));
 		pm8001_dev->dying = 1;
-		if (pm8001_dev->running_req) {
-			int i;
+		if (atomic_read(&pm8001_dev->running_req)) {
 			u32 *m;
 			struct pm8001_ccb_info *ccb;
 
 			PM8001_EH_DBG(pm8001_ha, 
-				pm8001_printk("DEV GONE %p rrq %d id %d\n", pm8001_dev, pm8001_dev->running_req, pm8001_dev->id));
-			FOR_ALL_CCB(ccb) {
-					if (ccb->device != pm8001_dev || ccb->task == NULL) {
+				pm8001_printk("DEV GONE %p rrq %d id %d\n", pm8001_dev, atomic_read(&pm8001_dev->running_req), pm8001_dev->id));
+			spin_lock(&pm8001_dev->ccb_lock);
+			list_for_each_entry(ccb, &pm8001_dev->ccb_list, dev_list) {
+					if (ccb->task == NULL) {
 						continue;
 					}
 					m = (u32 *) ccb->cmd;
@@ -1002,14 +1315,18 @@ static void pm8001_dev_gone_notify(struct domain_device *dev)
 						pm8001_printk("ccb %p CCB tag 0x%x opc %x\n", ccb, m[0], ccb->opCode & 0xfff));
 					ccb->aborting = 1;
 			}
-			spin_unlock_irqrestore(&pm8001_ha->lock, flags);
+			spin_unlock(&pm8001_dev->ccb_lock);
+			pm8001_unlock_all(pm8001_ha, flags);
 			pm8001_exec_internal_task_abort(pm8001_ha, pm8001_dev,
 				dev, 1, 0);
-			spin_lock_irqsave(&pm8001_ha->lock, flags);
+			pm8001_lock_all(pm8001_ha, &flags);
 		}
+		/* the post needs an iq_lock, which pm8001_lock_all holds */
+		pm8001_unlock_all(pm8001_ha, flags);
 		PM8001_CHIP_DISP->dereg_dev_req(pm8001_ha, device_id);
-		if (pm8001_dev->running_req) {
-			PM8001_FAIL_DBG(pm8001_ha, pm8001_printk("freeing device with %d still running\n", pm8001_dev->running_req));
+		pm8001_lock_all(pm8001_ha, &flags);
+		if (atomic_read(&pm8001_dev->running_req)) {
+			PM8001_FAIL_DBG(pm8001_ha, pm8001_printk("freeing device with %d still running\n", atomic_read(&pm8001_dev->running_req)));
 		}
 		pm8001_free_dev(pm8001_ha, pm8001_dev);
 	} else {
@@ -1017,7 +1334,7 @@ static void pm8001_dev_gone_notify(struct domain_device *dev)
 			pm8001_printk("Found dev has gone.\n"));
 	}
 	dev->lldd_dev = NULL;
-	spin_unlock_irqrestore(&pm8001_ha->lock, flags);
+	pm8001_unlock_all(pm8001_ha, flags);
 }
 
 void pm8001_dev_gone(struct domain_device *dev)
@@ -1052,17 +1369,14 @@ void pm8001_cancel_requests(struct domain_device *dev, int rc)
 
 	pm8001_ha = pm8001_find_ha_by_dev(dev);
 	if (pm8001_dev) {
-		spin_lock_irqsave(&pm8001_ha->lock, flags);
-		if (pm8001_dev->running_req) {
-			int i;
+		pm8001_lock_all(pm8001_ha, &flags);
+		if (atomic_read(&pm8001_dev->running_req)) {
 			u32 *m;
 			struct pm8001_ccb_info *ccb;
 
-			pm8001_printk("CLEANING TASKS %p rrq %d id %d\n", pm8001_dev, pm8001_dev->running_req, pm8001_dev->id);
-			FOR_ALL_CCB(ccb) {
-					if (ccb->device != pm8001_dev || ccb->task == NULL) {
-						continue;
-					}
+			pm8001_printk("CLEANING TASKS %p rrq %d id %d\n", pm8001_dev, atomic_read(&pm8001_dev->running_req), pm8001_dev->id);
+			/* each one is unlinked as it is cleaned, so pop until empty */
+			while ((ccb = pm8001_dev_ccb_pop(pm8001_dev, NULL))) {
 					m = (u32 *) ccb->cmd;
 					PM8001_EH_DBG(pm8001_ha, 
 						pm8001_printk("ccb %p CCB tag 0x%x opc %x\n", ccb, m[0], ccb->opCode & 0xfff));
@@ -1089,7 +1403,7 @@ void pm8001_cancel_requests(struct domain_device *dev, int rc)
 					}
 				} /* for each ccb */
 		}     /* if requests pending */
-		spin_unlock_irqrestore(&pm8001_ha->lock, flags);
+		pm8001_unlock_all(pm8001_ha, flags);
 	}         /* if device exists */
 
 }
@@ -1107,47 +1421,31 @@ static int pm8001_issue_ssp_tmf(struct domain_device *dev,
 		tmf);
 }
 
-/* retry commands by ha, by task and/or by device */
-void pm8001_open_reject_retry(
+/*
+ * Retry the in-flight commands of one device, by task if given.  Called
+ * and returns with pm8001_lock_all held, but drops it around task_done.
+ */
+static void pm8001_open_reject_retry_dev(
 	struct pm8001_hba_info *pm8001_ha,
 	struct sas_task *task_to_close,
-	struct pm8001_device *device_to_close)
+	struct pm8001_device *pm8001_dev,
+	unsigned long *flags)
 {
-	int i;
-	unsigned long flags;
 	struct pm8001_ccb_info *ccb;
 
-	if (pm8001_ha == NULL)
-		return;
-
-	spin_lock_irqsave(&pm8001_ha->lock, flags);
-
-	FOR_ALL_CCB(ccb) {
+	/* popped ccbs are off the list, so the walk survives the unlock */
+	while ((ccb = pm8001_dev_ccb_pop(pm8001_dev, task_to_close))) {
 		struct sas_task *task;
 		struct task_status_struct *ts;
-		struct pm8001_device *pm8001_dev;
 		unsigned long flags1;
 		u32 tag;
 
-		pm8001_dev = ccb->device;
-		if (!pm8001_dev || (pm8001_dev->dev_type == NO_DEVICE))
-			continue;
-		if (!device_to_close) {
-			uintptr_t d = (uintptr_t)pm8001_dev
-					- (uintptr_t)&pm8001_ha->devices;
-			if (((d % sizeof(*pm8001_dev)) != 0)
-			 || ((d / sizeof(*pm8001_dev)) >= PM8001_MAX_DEVICES))
-				continue;
-		} else if (pm8001_dev != device_to_close)
-			continue;
 		tag = ccb->ccb_tag;
 		if (!tag || (tag == 0xFFFFFFFF))
 			continue;
 		task = ccb->task;
 		if (!task || !task->task_done)
 			continue;
-		if (task_to_close && (task != task_to_close))
-			continue;
 		ts = &task->task_status;
 		ts->resp = SAS_TASK_COMPLETE;
 		/* Force the midlayer to retry */
@@ -1168,12 +1466,43 @@ void pm8001_open_reject_retry(
 				flags1);
 			pm8001_ccb_task_free(pm8001_ha, task, ccb, tag);
 			mb();/* in order to force CPU ordering */
-			spin_unlock_irqrestore(&pm8001_ha->lock, flags);
+			pm8001_unlock_all(pm8001_ha, *flags);
 			task->task_done(task);
-			spin_lock_irqsave(&pm8001_ha->lock, flags);
+			pm8001_lock_all(pm8001_ha, flags);
 		}
+		if (task_to_close)
+			break;
 	}
-	spin_unlock_irqrestore(&pm8001_ha->lock, flags);
+}
+
+/* retry commands by ha, by task and/or by device */
+void pm8001_open_reject_retry(
+	struct pm8001_hba_info *pm8001_ha,
+	struct sas_task *task_to_close,
+	struct pm8001_device *device_to_close)
+{
+	int i;
+	unsigned long flags;
+	struct pm8001_device *pm8001_dev;
+
+	if (pm8001_ha == NULL)
+		return;
+
+	pm8001_lock_all(pm8001_ha, &flags);
+	if (device_to_close) {
+		if (device_to_close->dev_type != NO_DEVICE)
+			pm8001_open_reject_retry_dev(pm8001_ha, task_to_close,
+				device_to_close, &flags);
+	} else {
+		for (i = 0; i < PM8001_MAX_DEVICES; i++) {
+			pm8001_dev = &pm8001_ha->devices[i];
+			if (pm8001_dev->dev_type == NO_DEVICE)
+				continue;
+			pm8001_open_reject_retry_dev(pm8001_ha, task_to_close,
+				pm8001_dev, &flags);
+		}
+	}
+	pm8001_unlock_all(pm8001_ha, flags);
 }
 
 /**
@@ -1349,6 +1678,107 @@ int pm8001_query_task(struct sas_task *task)
 	return rc;
 }
 
+/*
+ * A wedged device gets its outstanding commands aborted one at a time by
+ * the midlayer, each abort waiting out its own timeout.  Once the pattern
+ * shows, abort the lot with a single abort-all instead.
+ */
+static int pm8001_abort_all_due(struct pm8001_device *pm8001_dev)
+{
+	unsigned long now = jiffies;
+	unsigned long flags;
+	int due;
+
+	spin_lock_irqsave(&pm8001_dev->ccb_lock, flags);
+	if (time_after(now, pm8001_dev->abort_window + PM8001_ABORT_WINDOW)) {
+		pm8001_dev->abort_window = now;
+		pm8001_dev->abort_count = 0;
+		pm8001_dev->abort_fails = 0;
+	}
+	pm8001_dev->abort_count++;
+	due = pm8001_dev->abort_fails ||
+		(pm8001_dev->abort_count >= PM8001_ABORT_ALL_AFTER);
+	spin_unlock_irqrestore(&pm8001_dev->ccb_lock, flags);
+	if (atomic_read(&pm8001_dev->running_req) < PM8001_ABORT_ALL_MIN)
+		return 0;
+	return due;
+}
+
+/*
+ * The abort-all IOMB and the sweep after it take every LUN's commands
+ * with them, but ABORT TASK SET only reaches one LUN.  Only go that way
+ * when nothing in flight belongs to another LUN.
+ */
+static int pm8001_abort_all_one_lun(struct pm8001_device *pm8001_dev,
+	struct sas_task *task)
+{
+	struct pm8001_ccb_info *ccb;
+	unsigned long flags;
+	int one = 1;
+
+	if (!(task->task_proto & SAS_PROTOCOL_SSP))
+		return 1;
+	spin_lock_irqsave(&pm8001_dev->ccb_lock, flags);
+	list_for_each_entry(ccb, &pm8001_dev->ccb_list, dev_list) {
+		if (ccb->task == NULL ||
+		    !(ccb->task->task_proto & SAS_PROTOCOL_SSP))
+			continue;
+		if (memcmp(ccb->task->ssp_task.LUN, task->ssp_task.LUN, 8)) {
+			one = 0;
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&pm8001_dev->ccb_lock, flags);
+	return one;
+}
+
+/**
+  * pm8001_abort_all - abort every command a device has in flight.
+  * @pm8001_ha: our hba card information
+  * @pm8001_dev: the device
+  * @task: the task the midlayer asked about, for its LUN
+  *
+  * One ABORT TASK SET to the LUN for SSP, one abort-all IOMB to the
+  * firmware, then whatever has not completed is swept off the device's
+  * ccb list in one pass.
+  */
+static int pm8001_abort_all(struct pm8001_hba_info *pm8001_ha,
+	struct pm8001_device *pm8001_dev, struct sas_task *task)
+{
+	struct domain_device *dev = task->dev;
+	struct pm8001_tmf_task tmf_task;
+	struct scsi_lun lun;
+	unsigned long flags;
+	int swept, rc;
+
+	swept = atomic_read(&pm8001_dev->running_req);
+	PM8001_EH_DBG(pm8001_ha,
+		pm8001_printk("abort all %d to deviceid= %d\n", swept,
+			pm8001_dev->device_id));
+	if (task->task_proto & SAS_PROTOCOL_SSP) {
+		struct scsi_cmnd *cmnd = task->uldd_task;
+
+		if (unlikely(!cmnd || !cmnd->device))
+			return TMF_RESP_FUNC_FAILED;
+		int_to_scsilun(cmnd->device->lun, &lun);
+		tmf_task.tmf = TMF_ABORT_TASK_SET;
+		rc = pm8001_issue_ssp_tmf(dev, lun.scsi_lun, &tmf_task);
+		if (rc != TMF_RESP_FUNC_COMPLETE)
+			return rc;
+	}
+	rc = pm8001_exec_internal_task_abort(pm8001_ha, pm8001_dev, dev, 1, 0);
+	if (rc != TMF_RESP_FUNC_COMPLETE)
+		return rc;
+	pm8001_cancel_requests(dev, rc);
+	atomic_inc(&pm8001_ha->abort_all);
+	atomic_add(swept, &pm8001_ha->abort_swept);
+	spin_lock_irqsave(&pm8001_dev->ccb_lock, flags);
+	pm8001_dev->abort_count = 0;
+	pm8001_dev->abort_fails = 0;
+	spin_unlock_irqrestore(&pm8001_dev->ccb_lock, flags);
+	return rc;
+}
+
 /*  mandatory SAM-3, still need free task/ccb info, abord the specified task */
 int pm8001_abort_task(struct sas_task *task)
 {
@@ -1372,6 +1802,15 @@ int pm8001_abort_task(struct sas_task *task)
 		goto out;
 	}
 	spin_unlock_irqrestore(&task->task_state_lock, flags);
+	pm8001_dev = task->dev->lldd_dev;
+	if (!(task->task_proto & SAS_PROTOCOL_SMP) &&
+	    pm8001_abort_all_due(pm8001_dev) &&
+	    pm8001_abort_all_one_lun(pm8001_dev, task)) {
+		pm8001_ha = pm8001_find_ha_by_dev(task->dev);
+		rc = pm8001_abort_all(pm8001_ha, pm8001_dev, task);
+		/* no use going one by one after that, escalate instead */
+		goto out;
+	}
 	if (task->task_proto & SAS_PROTOCOL_SSP) {
 		struct scsi_cmnd *cmnd = task->uldd_task;
 		dev = task->dev;
@@ -1424,6 +1863,13 @@ int pm8001_abort_task(struct sas_task *task)
 			pm8001_dev->sas_device, 0, tag);
 
 	}
+	if (pm8001_ha)
+		atomic_inc(&pm8001_ha->abort_single);
+	if (rc != TMF_RESP_FUNC_COMPLETE) {
+		spin_lock_irqsave(&pm8001_dev->ccb_lock, flags);
+		pm8001_dev->abort_fails++;
+		spin_unlock_irqrestore(&pm8001_dev->ccb_lock, flags);
+	}
 out:
 	if (rc != TMF_RESP_FUNC_COMPLETE)
 		pm8001_printk("rc= %d\n", rc);
@@ -1491,67 +1937,207 @@ int pm8001_eh_bus_reset_handler(struct scsi_cmnd *cmnd)
 }
 
 /**
- *	pm8001_reregister_dev
+ *	pm8001_reregister_dev - register every known device with the firmware
  *	@pm8001_ha: our hba card information
+ *
+ *	The requests are pipelined: as many as the high priority queue holds
+ *	are posted before the first response is waited on.  All of them share
+ *	one completion, which counts the responses.  A device whose request
+ *	could not be posted is tried once more after every response is in.
  */
 static void pm8001_reregister_dev(struct pm8001_hba_info *pm8001_ha)
 {
-	u32 i;
-
-	for (i = 0; i < PM8001_MAX_DEVICES; i++) {
+	u32 i, n, pass, window, inflight = 0, drained = 0;
+	DECLARE_COMPLETION_ONSTACK(completion);
+	DECLARE_BITMAP(retry, PM8001_MAX_DEVICES);
+
+	window = pm8001_ha->mpi_queue_depth - PM8001_REREG_RESERVE;
+	pm8001_ha->reset_rereg_devs = 0;
+	pm8001_ha->reset_rereg_depth = 0;
+	bitmap_zero(retry, PM8001_MAX_DEVICES);
+	/* every device, then a second pass over those to retry */
+	for (n = 0; n < 2 * PM8001_MAX_DEVICES; n++) {
 		unsigned long flags;
-		int direct;
+		int direct, rc;
 		struct domain_device *dev;
-		DECLARE_COMPLETION_ONSTACK(completion);
-		struct pm8001_device *pm8001_dev = &pm8001_ha->devices[i];
+		struct pm8001_device *pm8001_dev;
 
+		pass = n / PM8001_MAX_DEVICES;
+		i = n % PM8001_MAX_DEVICES;
+		pm8001_dev = &pm8001_ha->devices[i];
 		if (pm8001_dev->dev_type == NO_DEVICE)
 			continue;
+		if (pass && !test_bit(i, retry))
+			continue;
+		if (pass && !drained) {
+			/*
+			 * even an empty window failed the first time, so let
+			 * everything out, ours and whatever held the tags
+			 */
+			while (inflight) {
+				wait_for_completion(&completion);
+				--inflight;
+			}
+			msleep(PM8001_REREG_RETRY_MS);
+			drained = 1;
+		}
 
 		direct = 0;
 		dev = pm8001_dev->sas_device;
 		if (dev && !dev->parent && (dev->dev_type == SATA_DEV))
 			direct = 1;
 		pm8001_dev->dcompletion = &completion;
-		spin_lock_irqsave(&pm8001_ha->lock, flags);
-		PM8001_CHIP_DISP->reg_dev_req(pm8001_ha, pm8001_dev, direct);
-		spin_unlock_irqrestore(&pm8001_ha->lock, flags);
+		for (;;) {
+			if (inflight >= window) {
+				wait_for_completion(&completion);
+				--inflight;
+			}
+			spin_lock_irqsave(&pm8001_ha->lock, flags);
+			rc = PM8001_CHIP_DISP->reg_dev_req(pm8001_ha,
+				pm8001_dev, direct);
+			spin_unlock_irqrestore(&pm8001_ha->lock, flags);
+			/* out of queue entries or tags: drain one and retry */
+			if (!rc || !inflight)
+				break;
+			wait_for_completion(&completion);
+			--inflight;
+		}
+		if (rc) {
+			/* no response is coming to complete it */
+			pm8001_dev->dcompletion = NULL;
+			if (!pass) {
+				__set_bit(i, retry);
+				continue;
+			}
+			PM8001_FAIL_DBG(pm8001_ha,
+				pm8001_printk("dev[%d] 0x%016llx not registered"
+					" rc %d\n", pm8001_dev->id,
+					SAS_ADDR(dev->sas_addr), rc));
+			continue;
+		}
+		++pm8001_ha->reset_rereg_devs;
+		if (++inflight > pm8001_ha->reset_rereg_depth)
+			pm8001_ha->reset_rereg_depth = inflight;
+	}
+	while (inflight--)
 		wait_for_completion(&completion);
+	for (i = 0; i < PM8001_MAX_DEVICES; i++) {
+		struct pm8001_device *pm8001_dev = &pm8001_ha->devices[i];
+
+		/* the completion goes out of scope here */
+		pm8001_dev->dcompletion = NULL;
+		if (pm8001_dev->dev_type == NO_DEVICE)
+			continue;
 		PM8001_EH_DBG(pm8001_ha,
 			pm8001_printk("dev[%d:%x] 0x%016llx registered.\n",
 				pm8001_dev->device_id,
 				pm8001_dev->dev_type,
-				SAS_ADDR(dev->sas_addr)));
+				SAS_ADDR(pm8001_dev->sas_device->sas_addr)));
 	}
 }
 
-static int pm8001_host_reset(struct pm8001_hba_info *pm8001_ha)
+/**
+ *	pm8001_reset_mark - note a host reset milestone for debugfs
+ *	@pm8001_ha: our hba card information
+ *	@event: enum pm8001_reset_event
+ *	@phy: the phy it concerns, if any
+ */
+void pm8001_reset_mark(struct pm8001_hba_info *pm8001_ha, u16 event, u16 phy)
 {
-	int ret, phy_id;
-	unsigned long flags;
-	DECLARE_COMPLETION_ONSTACK(completion);
+	int i;
 
+	if (!pm8001_ha->reset_active)
+		return;
+	i = atomic_inc_return(&pm8001_ha->reset_nmark) - 1;
+	if (i >= PM8001_RESET_MARKS)
+		return;
+	pm8001_ha->reset_mark[i].usecs =
+		ktime_to_us(ktime_sub(ktime_get(), pm8001_ha->reset_start));
+	pm8001_ha->reset_mark[i].event = event;
+	pm8001_ha->reset_mark[i].phy = phy;
+}
+
+/*
+ * All phys are started at once.  Rather than sleep for the links to settle,
+ * wait for the phys that were up before the reset to report PHY_UP again,
+ * bounded by PM8001_PHY_UP_TIMEOUT.
+ */
+static int pm8001_host_reset(struct pm8001_hba_info *pm8001_ha)
+{
+	int ret, phy_id, n;
+	unsigned long flags, timeout, attached = 0;
+	ktime_t phase;
+
+	pm8001_ha->reset_start = ktime_get();
+	atomic_set(&pm8001_ha->reset_nmark, 0);
+	pm8001_ha->reset_active = 1;
+	++pm8001_ha->reset_count;
+	for (phy_id = 0; phy_id < pm8001_ha->chip->n_phy; ++phy_id)
+		if (pm8001_ha->phy[phy_id].phy_attached)
+			__set_bit(phy_id, &attached);
+	ret = FAILED;
 	PM8001_CHIP_DISP->chip_rst(pm8001_ha);
-	ret = PM8001_CHIP_DISP->chip_hda_mode(pm8001_ha);
-	if (!ret)
-		return FAILED;
-	ret = PM8001_CHIP_DISP->chip_init(pm8001_ha);
-	if (ret)
-		return FAILED;
+	pm8001_reset_mark(pm8001_ha, PM8001_RESET_CHIP_RST, 0);
+	if (!PM8001_CHIP_DISP->chip_hda_mode(pm8001_ha))
+		goto out;
+	if (PM8001_CHIP_DISP->chip_init(pm8001_ha))
+		goto out;
 	PM8001_CHIP_DISP->interrupt_enable(pm8001_ha);
+	pm8001_reset_mark(pm8001_ha, PM8001_RESET_CHIP_INIT, 0);
+	phase = ktime_get();
+	pm8001_ha->reset_chip_usecs =
+		ktime_to_us(ktime_sub(phase, pm8001_ha->reset_start));
+
+	INIT_COMPLETION(pm8001_ha->phy_start_done);
 	for (phy_id = 0; phy_id < pm8001_ha->chip->n_phy; ++phy_id) {
-		pm8001_ha->phy[phy_id].enable_completion = &completion;
+		pm8001_ha->phy[phy_id].enable_completion =
+			&pm8001_ha->phy_start_done;
 		spin_lock_irqsave(&pm8001_ha->lock, flags);
-		ret = PM8001_CHIP_DISP->phy_start_req(pm8001_ha, phy_id);
+		n = PM8001_CHIP_DISP->phy_start_req(pm8001_ha, phy_id);
 		spin_unlock_irqrestore(&pm8001_ha->lock, flags);
-		if (ret)
-			return FAILED;
-		wait_for_completion(&completion);
+		if (n)
+			goto out;
+		pm8001_reset_mark(pm8001_ha, PM8001_RESET_PHY_START, phy_id);
+	}
+	timeout = PM8001_PHY_START_TIMEOUT;
+	for (n = pm8001_ha->chip->n_phy; n && timeout; --n)
+		timeout = wait_for_completion_timeout(
+			&pm8001_ha->phy_start_done, timeout);
+	if (n)
+		PM8001_FAIL_DBG(pm8001_ha,
+			pm8001_printk("%d phys did not start\n", n));
+
+	/* arm before the link resets so no PHY_UP is missed */
+	INIT_COMPLETION(pm8001_ha->phy_up_done);
+	smp_wmb();
+	pm8001_ha->phy_up_wait = attached;
+	for (phy_id = 0; phy_id < pm8001_ha->chip->n_phy; ++phy_id) {
 		PM8001_CHIP_DISP->phy_ctl_req(pm8001_ha, phy_id,
 					      PHY_LINK_RESET);
+		pm8001_reset_mark(pm8001_ha, PM8001_RESET_PHY_LINK_RESET,
+			phy_id);
+	}
+	timeout = PM8001_PHY_UP_TIMEOUT;
+	for (n = hweight_long(attached); n && timeout; --n)
+		timeout = wait_for_completion_timeout(&pm8001_ha->phy_up_done,
+			timeout);
+	attached = xchg(&pm8001_ha->phy_up_wait, 0);
+	for (phy_id = 0; phy_id < pm8001_ha->chip->n_phy; ++phy_id) {
+		if (!test_bit(phy_id, &attached))
+			continue;
+		pm8001_reset_mark(pm8001_ha, PM8001_RESET_PHY_TIMEOUT, phy_id);
+		PM8001_FAIL_DBG(pm8001_ha,
+			pm8001_printk("phy %d not up after reset\n", phy_id));
 	}
-	msleep(2000); /* phy start and phy reset settling time */
+	pm8001_ha->reset_phy_usecs =
+		ktime_to_us(ktime_sub(ktime_get(), phase));
+
+	phase = ktime_get();
 	pm8001_reregister_dev(pm8001_ha);
+	pm8001_reset_mark(pm8001_ha, PM8001_RESET_REREG,
+		pm8001_ha->reset_rereg_devs);
+	pm8001_ha->reset_rereg_usecs =
+		ktime_to_us(ktime_sub(ktime_get(), phase));
 	/* Close the window should we have missed any events */
 	for (phy_id = 0; phy_id < pm8001_ha->chip->n_phy; ++phy_id) {
 		struct sas_ha_struct *sas_ha = pm8001_ha->sas;
@@ -1562,7 +2148,19 @@ static int pm8001_host_reset(struct pm8001_hba_info *pm8001_ha)
 		spin_unlock_irqrestore(&sas_phy->sas_prim_lock, flags);
 		sas_ha->notify_port_event(sas_phy, PORTE_BROADCAST_RCVD);
 	}
-	return SUCCESS;
+	pm8001_ha->reset_usecs =
+		ktime_to_us(ktime_sub(ktime_get(), pm8001_ha->reset_start));
+	pm8001_reset_mark(pm8001_ha, PM8001_RESET_DONE, 0);
+	PM8001_EH_DBG(pm8001_ha,
+		pm8001_printk("host reset %uus: chip %uus phy %uus"
+			" %u devices %uus\n", pm8001_ha->reset_usecs,
+			pm8001_ha->reset_chip_usecs, pm8001_ha->reset_phy_usecs,
+			pm8001_ha->reset_rereg_devs,
+			pm8001_ha->reset_rereg_usecs));
+	ret = SUCCESS;
+out:
+	pm8001_ha->reset_active = 0;
+	return ret;
 }
 
 /**
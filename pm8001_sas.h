@@ -50,9 +50,11 @@
 #include <linux/types.h>
 #include <linux/ctype.h>
 #include <linux/dma-mapping.h>
+#include <linux/dmapool.h>
 #include <linux/pci.h>
 #include <linux/interrupt.h>
 #include <linux/workqueue.h>
+#include <linux/ktime.h>
 #include <scsi/scsi.h>
 #include <scsi/libsas.h>
 #include <scsi/scsi_tcq.h>
@@ -112,17 +114,19 @@ do {						\
 
 #if (PM8001_MAX_CCB_ARRAY == 1)
 #define	FOR_ALL_CCB(ccb)						     \
-	for (i = 0; ccb = &pm8001_ha->ccb_info[i], i < PM8001_MAX_CCB; i++)
+	for (i = 0; ccb = &pm8001_ha->ccb_info[i], i < pm8001_ha->ccb_count; i++)
 #else
 #define	FOR_ALL_CCB(ccb)						     \
 	for (i = 0; ccb = &pm8001_ha->ccb_info[i / PM8001_CCB_PER_ARRAY]     \
 	[i % PM8001_CCB_PER_ARRAY],					     \
-	i < (PM8001_MAX_CCB_ARRAY * PM8001_CCB_PER_ARRAY); i++)
+	i < pm8001_ha->ccb_count; i++)
 #endif	
 
 #define PM8001_USE_TASKLET
 #define PM8001_USE_MSIX
 #define PM8001_READ_VPD
+/* time SSP/SATA completion handlers, reported in sysfs completion_stats */
+/* #define PM8001_COMPLETION_PROFILE */
 
 #define DEV_IS_EXPANDER(type)	((type == EDGE_DEV) || (type == FANOUT_DEV))
 
@@ -133,6 +137,16 @@ extern const struct pm8001_dispatch pm8001_8001_dispatch;
 struct pm8001_hba_info;
 struct pm8001_ccb_info;
 struct pm8001_device;
+struct inbound_queue_table;
+/*
+ * A submitter's doorbell batch.  It lives on the submitter's stack from
+ * iq_plug to iq_unplug and names the queue the whole batch posts to, so
+ * other submitters of that queue are never held back by it.
+ */
+struct pm8001_iq_plug {
+	struct inbound_queue_table *circularQ;
+	u32			pending;/* posted under this plug, not yet rung */
+};
 /* define task management IU */
 struct pm8001_tmf_task {
 	u8	tmf;
@@ -158,18 +172,25 @@ struct pm8001_dispatch {
 	void (*chip_rst)(struct pm8001_hba_info *pm8001_ha);
 	int (*chip_ioremap)(struct pm8001_hba_info *pm8001_ha);
 	void (*chip_iounmap)(struct pm8001_hba_info *pm8001_ha);
-	irqreturn_t (*isr)(struct pm8001_hba_info *pm8001_ha);
+	irqreturn_t (*isr)(struct pm8001_hba_info *pm8001_ha, u8 vec);
 	u32 (*is_our_interupt)(struct pm8001_hba_info *pm8001_ha);
-	int (*isr_process_oq)(struct pm8001_hba_info *pm8001_ha);
+	void (*isr_mask)(struct pm8001_hba_info *pm8001_ha, u8 vec);
+	int (*isr_poll)(struct pm8001_hba_info *pm8001_ha, u8 vec, int budget);
+	int (*oq_spin)(struct pm8001_hba_info *pm8001_ha,
+		struct pm8001_ccb_info *ccb, u32 tag);
 	void (*interrupt_enable)(struct pm8001_hba_info *pm8001_ha);
 	void (*interrupt_disable)(struct pm8001_hba_info *pm8001_ha);
 	void (*make_prd)(struct scatterlist *scatter, int nr, void *prd);
+	void (*iq_plug)(struct pm8001_hba_info *pm8001_ha,
+		struct pm8001_iq_plug *plug);
+	void (*iq_unplug)(struct pm8001_hba_info *pm8001_ha,
+		struct pm8001_iq_plug *plug);
 	int (*smp_req)(struct pm8001_hba_info *pm8001_ha,
 		struct pm8001_ccb_info *ccb);
 	int (*ssp_io_req)(struct pm8001_hba_info *pm8001_ha,
-		struct pm8001_ccb_info *ccb);
+		struct pm8001_ccb_info *ccb, struct pm8001_iq_plug *plug);
 	int (*sata_req)(struct pm8001_hba_info *pm8001_ha,
-		struct pm8001_ccb_info *ccb);
+		struct pm8001_ccb_info *ccb, struct pm8001_iq_plug *plug);
 	int (*phy_start_req)(struct pm8001_hba_info *pm8001_ha,	u8 phy_id);
 	int (*phy_stop_req)(struct pm8001_hba_info *pm8001_ha, u8 phy_id);
 	int (*reg_dev_req)(struct pm8001_hba_info *pm8001_ha,
@@ -226,6 +247,25 @@ struct pm8001_phy {
 	enum sas_linkrate	maximum_linkrate;
 };
 
+/* host reset timeline, see pm8001_reset_mark() */
+enum pm8001_reset_event {
+	PM8001_RESET_CHIP_RST,
+	PM8001_RESET_CHIP_INIT,
+	PM8001_RESET_PHY_START,
+	PM8001_RESET_PHY_STARTED,
+	PM8001_RESET_PHY_LINK_RESET,
+	PM8001_RESET_PHY_UP,
+	PM8001_RESET_PHY_TIMEOUT,
+	PM8001_RESET_REREG,
+	PM8001_RESET_DONE,
+};
+
+struct pm8001_reset_mark {
+	u32			usecs;/* since the reset started */
+	u16			event;
+	u16			phy;
+};
+
 struct pm8001_device {
 	enum sas_dev_type	dev_type;
 	struct domain_device	*sas_device;
@@ -234,20 +274,36 @@ struct pm8001_device {
 	struct completion	*dcompletion;
 	struct completion	*setds_completion;
 	u32			device_id;
-	u32			running_req;
+	atomic_t		running_req;
 	int dying;
 	int orej;
+	/* open reject backoff, under pm8001_ha->orej_lock */
+	u32			orej_backoff;/* msec, 0 while calm */
+	unsigned long		orej_last;/* jiffies of the last retry */
+	unsigned long		orej_window_start;
+	u32			orej_window;/* retries this second so far */
+	u32			orej_rate;/* retries in the last full second */
+	u32			orej_retries;
+	u32			orej_held;/* of those, delayed on the wheel */
+	/* recent aborts, see pm8001_abort_all_due() */
+	unsigned long		abort_window;
+	u32			abort_count;
+	u32			abort_fails;
+	u32			stall_ms;/* flag commands older than this, 0 never */
+	u32			stuck;/* commands flagged so far */
+	/* last, so pm8001_free_dev can clear the rest around them */
+	spinlock_t		ccb_lock;/* guards ccb_list, abort_* */
+	struct list_head	ccb_list;/* ccbs in flight to this device */
 };
 #define	INC_REQ(d, h)										\
-	(d)->running_req++;									\
-	PM8001_MSG_DBG2(h, pm8001_printk("%p %u requests now running\n", d, (d)->running_req));	\
+	atomic_inc(&(d)->running_req);								\
+	PM8001_MSG_DBG2(h, pm8001_printk("%p %u requests now running\n", d, atomic_read(&(d)->running_req)));	\
 	do { ; } while (0)
 
 #define	DEC_REQ(d, h)											\
 	if (d) {											\
-		BUG_ON((d)->running_req == 0);								\
-		(d)->running_req--;									\
-		PM8001_MSG_DBG2(h, pm8001_printk("%p %u requests now running\n", d, (d)->running_req));	\
+		BUG_ON(atomic_dec_return(&(d)->running_req) < 0);					\
+		PM8001_MSG_DBG2(h, pm8001_printk("%p %u requests now running\n", d, atomic_read(&(d)->running_req)));	\
 	}												\
 	do { } while (0)
 
@@ -262,21 +318,33 @@ struct pm8001_prd {
 } __attribute__ ((packed));
 /*
  * CCB(Command Control Block)
+ *
+ * The first cache line holds everything a submission and a completion
+ * look at, the device list linkage included; the IOMB staging area is
+ * only written at submission and sits on its own line, and what only
+ * the optional features read comes after it.
  */
 struct pm8001_ccb_info {
-	struct list_head	entry;
 	struct sas_task		*task;
-	u32			n_elem;
-	u32			ccb_tag;
-	dma_addr_t		ccb_dma_handle;
 	struct pm8001_device	*device;
-	struct pm8001_prd	buf_prd[PM8001_MAX_DMA_SG];
-	struct fw_control_ex	*fw_control_context;
-	u32			opCode;
-	u8			cmd[60];
+	u32			ccb_tag;
+	u16			n_elem;
+	u8			track;/* go on device->ccb_list once posted */
+	u8			stalled;/* flagged by the stall scan */
 	u8			aborting;
 	u8			open_retry;
-};
+	u16			tag_serno;/* generation, bumped per alloc */
+	u8			sgl_class;
+	u8			oq;/* outbound queue the response comes on */
+	u16			cpu;/* submitted from, completed back on */
+	struct pm8001_prd	*sgl;/* external sg table, borrowed per I/O */
+	dma_addr_t		sgl_dma;
+	struct list_head	dev_list;/* on device->ccb_list while in flight */
+	u32			opCode ____cacheline_aligned;
+	u8			cmd[60];
+	struct fw_control_ex	*fw_control_context;/* rare */
+	ktime_t			issued;/* stall scan/histogram, or 0 */
+} ____cacheline_aligned;
 
 struct mpi_mem {
 	void			*virt_ptr;
@@ -546,6 +614,13 @@ struct inbound_queue_table {
 	u32			reserved;
 	__le32			consumer_index;
 	u32			producer_idx;
+	u32			free_slots;/* known free, CI read lazily */
+	u32			ci_reads;/* ci_virt refreshes */
+	spinlock_t		iq_lock;/* protects producer_idx */
+	u32			db_pending;/* IOMBs posted, PI not yet rung */
+	u64			iomb_posted;/* IOMBs built on this queue */
+	u64			db_rung;/* PI doorbell writes */
+	u32			iq_contended;/* iq_lock found busy */
 };
 struct outbound_queue_table {
 	u32			element_size_cnt;
@@ -562,6 +637,51 @@ struct outbound_queue_table {
 	u32			dinterrup_to_pci_offset;
 	__le32			producer_index;
 	u32			consumer_idx;
+	u32			ci_published;/* consumer_idx last told the chip */
+	u32			ci_writes;/* consumer index MMIO writes */
+	spinlock_t		oq_lock;/* serialises draining this queue */
+	u32			oq_contended;/* oq_lock found busy */
+	u32			poll_passes;/* budgeted drains run */
+	u32			poll_exhausted;/* passes that used the budget */
+	u32			poll_max;/* most IOMBs in one pass */
+	u64			iombs;/* IOMBs handled */
+	u64			irqs;/* interrupts taken */
+	u32			coal_count;/* interrupt after this many IOMBs */
+	u32			coal_delay;/* or this many usec */
+	u32			coal_want;/* adaptive target, count << 16 | delay */
+	unsigned long		coal_next;/* next adaptive evaluation */
+	u64			coal_iombs;/* iombs at the last evaluation */
+	u32			spinning;/* drained by a submitter's spin */
+	/* ssp completion latency, [reaped by interrupt/by spin][log2 usec] */
+	u32			lat_hist[2][PM8001_LAT_BUCKETS];
+#ifdef PM8001_COMPLETION_PROFILE
+	u64			ssp_comp;
+	u64			ssp_cycles;
+	u64			sata_comp;
+	u64			sata_cycles;
+#endif
+};
+/* tasks finished during an outbound drain, completed after the unlock */
+struct pm8001_done_batch {
+	u32			count;
+	u32			overflow;/* batch full, completed in place */
+	u64			tasks;/* completed from the batch */
+	u64			flushes;
+	u64			same_cpu;/* finished where they were submitted */
+	u64			cross_cpu;/* finished on another cpu */
+	u64			steered;/* of those, handed back to the submitter */
+	u64			ipis;
+	u16			cpu[PM8001_DONE_BATCH];/* submitter of task[] */
+	struct sas_task		*task[PM8001_DONE_BATCH];
+	/* tasks other cpus steered back to this one */
+	spinlock_t		remote_lock;
+	u32			remote_count;
+	struct sas_task		*remote[PM8001_DONE_BATCH];
+};
+/* cpus to interrupt after a drain, on the draining context's stack */
+struct pm8001_done_kick {
+	u32			n;
+	u16			cpu[PM8001_DONE_BATCH];
 };
 struct eventlog_header {
 	__le32			signature;
@@ -591,11 +711,18 @@ struct pm8001_hba_memspace {
 	u64			membase;
 	u32			memsize;
 };
+/* per interrupt vector context, handed to request_irq and the tasklets */
+struct isr_param {
+	struct pm8001_hba_info	*drv_inst;
+	u8			irq_id;/* vector, and the outbound queue it owns */
+};
+
 struct pm8001_hba_info {
 	char			name[PM8001_NAME_LENGTH];
 	struct list_head	list;
 	unsigned long		flags;
-	spinlock_t		lock;/* host-wide lock */
+	spinlock_t		lock;/* chip window and topology state */
+	u32			lock_contended;/* lock found busy */
 	struct pci_dev		*pdev;/* our device */
 	struct device		*dev;
 	struct pm8001_hba_memspace io_mem[6];
@@ -609,6 +736,35 @@ struct pm8001_hba_info {
 	struct general_status_table	gs_tbl;
 	struct inbound_queue_table	inbnd_q_tbl[PM8001_MAX_INB_NUM];
 	struct outbound_queue_table	outbnd_q_tbl[PM8001_MAX_OUTB_NUM];
+	u32			inbnd_q_num;/* inbound queues in use */
+	u32			outbnd_q_num;/* outbound queues, one per vector */
+	u32			db_batch;/* max IOMBs per inbound doorbell */
+	u32			poll_budget;/* max IOMBs per completion poll */
+	u32			coal_adaptive;/* coalescing follows the load */
+	u32			coal_count;/* fixed coalescing count */
+	u32			coal_delay;/* fixed coalescing delay, usec */
+	struct mutex		coal_mutex;/* one config table update at a time */
+	unsigned long		coal_dirty;/* queues with a coal_want to apply */
+	struct work_struct	coal_work;
+	u32			spin_usecs;/* submitters poll for completion */
+	u32			steer_completions;/* task_done on the submitter */
+	atomic_t		spin_hits;/* spins that saw their I/O done */
+	atomic_t		spin_misses;/* left to the interrupt */
+	/* the last host reset, usec per phase */
+	u32			reset_count;
+	u32			reset_usecs;
+	u32			reset_chip_usecs;
+	u32			reset_phy_usecs;
+	u32			reset_rereg_usecs;
+	u32			reset_rereg_devs;
+	u32			reset_rereg_depth;/* most in flight at once */
+	u32			reset_active;
+	ktime_t			reset_start;
+	struct completion	phy_start_done;/* counts PHY_START_STATUS */
+	struct completion	phy_up_done;/* counts phys back up */
+	unsigned long		phy_up_wait;/* phys the reset waits on */
+	atomic_t		reset_nmark;
+	struct pm8001_reset_mark reset_mark[PM8001_RESET_MARKS];
 	u8			sas_addr[PM8001_MAX_PHYS][SAS_ADDR_SIZE];
 	u64			sas_addr_def[PM8001_MAX_PHYS];
 	u8			sas_addr_set;
@@ -617,12 +773,39 @@ struct pm8001_hba_info {
 	u32			chip_id;
 	const struct pm8001_chip_info	*chip;
 	struct completion	*nvmd_completion;
-	u16			tags_serno;
-	int			tags_alloc;
+	atomic_t		tags_alloc;
+	u32			ccb_count;/* ccbs allocated at probe */
+	u32			can_queue;/* tags_num less the reserve */
+	u32			mpi_queue_depth;/* entries per mpi queue */
+	u32			mpi_queue_mask;/* power of two less one */
 	int			tags_num;
-	unsigned long		*tags;
+	unsigned long		*tags;/* atomic bitops only, no lock needed */
+	unsigned int		*tags_hint;/* percpu: where to start looking */
+	u8			*cpu_oq;/* percpu: outbound queue for its I/O */
+	struct pm8001_done_batch *done_batch;/* percpu: tasks to complete */
+	struct pm8001_work	*work_pool;/* for pm8001_handle_event */
+	unsigned long		*work_map;/* atomic bitops, set when in use */
+	u32			work_num;
+	u32			work_high;/* most in use at once */
+	atomic_t		work_busy;
+	atomic_t		work_exhausted;/* fell back to an allocation */
+	atomic_t		abort_single;/* per task aborts */
+	atomic_t		abort_all;/* device wide aborts */
+	atomic_t		abort_swept;/* commands those took down */
+	u32			orej_backoff_enable;
+	spinlock_t		orej_lock;/* the wheel and device backoff */
+	struct timer_list	orej_timer;
+	unsigned long		orej_next;/* first slot not yet run */
+	u32			orej_pending;
+	struct list_head	orej_wheel[PM8001_OREJ_SLOTS];
+	u32			stall_ms;/* default for new devices */
+	struct timer_list	stall_timer;
+	atomic_t		stall_flagged;/* commands found stalled */
+	atomic_t		stall_timedout;/* of those, handed to the EH */
+	struct dma_pool		*sgl_pool[PM8001_SGL_CLASSES];
+	u32			sgl_size[PM8001_SGL_CLASSES];/* PRDs each */
 #define	TAG_IDX_MASK(x)	(x & 0xffff)
-#define	TAG_MAKE(h, t)	((((((h)->tags_serno++) & 0x7fff) | 0x8000) << 16) | t)
+#define	TAG_MAKE(s, t)	(((((s) & 0x7fff) | 0x8000) << 16) | (t))
 	struct pm8001_phy	phy[PM8001_MAX_PHYS];
 	struct pm8001_port	port[PM8001_MAX_PHYS];
 	u32			id;
@@ -634,11 +817,12 @@ struct pm8001_hba_info {
 	struct pm8001_ccb_info	*ccb_info[PM8001_MAX_CCB_ARRAY];	
 #endif	
 #ifdef PM8001_USE_MSIX
-	struct msix_entry	msix_entries[16];/*for msi-x interrupt*/
+	struct msix_entry	msix_entries[PM8001_MAX_MSIX_VEC];
 	int			number_of_intr;/*will be used in remove()*/
 #endif
+	struct isr_param	irq_vector[PM8001_MAX_MSIX_VEC];/* irq cookies */
 #ifdef PM8001_USE_TASKLET
-	struct tasklet_struct	tasklet;
+	struct tasklet_struct	tasklet[PM8001_MAX_MSIX_VEC];
 #endif
 	u32			brcvd;
 	u32			logging_level;
@@ -666,6 +850,13 @@ struct pm8001_work {
 	struct pm8001_hba_info *pm8001_ha;
 	void *data;
 	int handler;
+	/* open reject retries held back on the backoff wheel */
+#define	PM8001_WORK_OREJ_RETRY	0x10000	/* handler, beyond the IO_ codes */
+#define	PM8001_WORK_STALL	0x10001
+	struct list_head wheel;
+	struct sas_task *task;
+	u32 tag;
+	struct domain_device *dev;/* data's, to tell the slot was not reused */
 };
 
 struct pm8001_fw_image_header {
@@ -759,12 +950,44 @@ static __inline struct pm8001_ccb_info *get_ccb_array(
 	return ccb;
 }
 
+/**
+ * pm8001_spin_lock_counted - spin_lock, counting the times we had to wait
+ * @lock: the lock
+ * @contended: bumped once the lock is held if it was not free at first
+ */
+static inline void pm8001_spin_lock_counted(spinlock_t *lock, u32 *contended)
+{
+	if (!spin_trylock(lock)) {
+		spin_lock(lock);
+		(*contended)++;
+	}
+}
+
 /******************** function prototype *********************/
+void pm8001_lock_all(struct pm8001_hba_info *pm8001_ha, unsigned long *flags);
+void pm8001_unlock_all(struct pm8001_hba_info *pm8001_ha, unsigned long flags);
 void pm8001_tag_free(struct pm8001_hba_info *pm8001_ha, u32 tag);
 int pm8001_tag_alloc(struct pm8001_hba_info *pm8001_ha, u32 *tag_out);
 void pm8001_tag_init(struct pm8001_hba_info *pm8001_ha);
 u32 pm8001_get_ncq_tag(struct sas_task *task, u32 *tag);
 void pm8001_ccb_free(struct pm8001_hba_info *pm8001_ha, u32 ccb_idx);
+void pm8001_ccb_link(struct pm8001_ccb_info *ccb);
+void pm8001_ccb_unlink(struct pm8001_ccb_info *ccb);
+struct pm8001_ccb_info *pm8001_task_ccb(struct sas_task *task);
+void pm8001_dev_init(struct pm8001_device *pm8001_dev);
+int pm8001_sgl_pool_init(struct pm8001_hba_info *pm8001_ha);
+void pm8001_sgl_pool_free(struct pm8001_hba_info *pm8001_ha);
+int pm8001_work_pool_init(struct pm8001_hba_info *pm8001_ha, u32 num);
+void pm8001_work_pool_free(struct pm8001_hba_info *pm8001_ha);
+void pm8001_orej_init(struct pm8001_hba_info *pm8001_ha);
+void pm8001_orej_stop(struct pm8001_hba_info *pm8001_ha);
+void pm8001_orej_drop(struct pm8001_hba_info *pm8001_ha,
+	struct pm8001_device *pm8001_dev);
+void pm8001_stall_init(struct pm8001_hba_info *pm8001_ha);
+void pm8001_stall_start(struct pm8001_hba_info *pm8001_ha);
+void pm8001_stall_stop(struct pm8001_hba_info *pm8001_ha);
+int pm8001_sgl_get(struct pm8001_hba_info *pm8001_ha,
+	struct pm8001_ccb_info *ccb, u32 n_elem);
 void pm8001_ccb_task_free(struct pm8001_hba_info *pm8001_ha,
 	struct sas_task *task, struct pm8001_ccb_info *ccb, u32 ccb_idx);
 int pm8001_phy_control(struct asd_sas_phy *sas_phy, enum phy_func func
@@ -795,6 +1018,11 @@ int pm8001_mem_alloc(struct pci_dev *pdev, void **virt_addr,
 	dma_addr_t *pphys_addr, u32 *pphys_addr_hi, u32 *pphys_addr_lo,
 	u32 mem_size, u32 align, void **real_va, size_t *real_len);
 void pm8001_update_main_config_table(struct pm8001_hba_info *pm8001_ha);
+int pm8001_set_coalesce(struct pm8001_hba_info *pm8001_ha, u32 number,
+	u32 count, u32 delay);
+void pm8001_coalesce_init(struct pm8001_hba_info *pm8001_ha);
+void pm8001_reset_mark(struct pm8001_hba_info *pm8001_ha, u16 event,
+	u16 phy);
 int pm8001_readlog(
 	struct eventlog_header *header,
 	struct eventlog_entry *entry,